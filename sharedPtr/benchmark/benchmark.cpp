@@ -0,0 +1,791 @@
+// benchmark.cpp : throughput of the library's shared_ptr/weak_ptr and
+// local_shared_ptr/local_weak_ptr against std::shared_ptr/std::weak_ptr, from
+// one thread up to the hardware concurrency of the machine. All threads of a
+// run share one object, so the multi-threaded numbers include the contention
+// on its reference counts.
+
+#include "sharedPtr.h"
+#include "atomicSharedPtr.h"
+#include "epochSharedPtr.h"
+#include "intrusivePtr.h"
+#include "relocate.h"
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+namespace
+{
+   struct base
+   {
+      virtual ~base() = default;
+      int m_value = 0;
+   };
+
+   struct derived : public base
+   {
+   };
+
+   struct pooled_base : public base
+   {
+   };
+}
+
+template<>
+struct use_control_block_pool<pooled_base> : std::true_type
+{
+};
+
+namespace
+{
+   // Resident set size of the process in KiB, 0 where it is not available.
+   double resident_set_kb()
+   {
+#ifdef __linux__
+      long pages = 0;
+      long residentPages = 0;
+      if (std::FILE* statm = std::fopen("/proc/self/statm", "r"))
+      {
+         if (std::fscanf(statm, "%ld %ld", &pages, &residentPages) != 2) residentPages = 0;
+         std::fclose(statm);
+      }
+      return static_cast<double>(residentPages) * sysconf(_SC_PAGESIZE) / 1024;
+#else
+      return 0;
+#endif
+   }
+
+   struct library_pointers
+   {
+      template<class T>
+      using shared = ::shared_ptr<T>;
+
+      template<class T>
+      using weak = ::weak_ptr<T>;
+
+      template<class T, class... ParamTypes>
+      static shared<T> make(ParamTypes&&... i_params)
+      {
+         return ::make_shared<T>(std::forward<ParamTypes>(i_params)...);
+      }
+
+      template<class T, class Alloc, class... ParamTypes>
+      static shared<T> allocate(const Alloc& i_alloc, ParamTypes&&... i_params)
+      {
+         return ::allocate_shared<T>(i_alloc, std::forward<ParamTypes>(i_params)...);
+      }
+
+      template<class T, class Pointer>
+      static shared<T> dynamic_cast_to(Pointer&& i_ptr)
+      {
+         return ::dynamic_pointer_cast<T>(std::forward<Pointer>(i_ptr));
+      }
+   };
+
+   struct local_pointers
+   {
+      template<class T>
+      using shared = ::local_shared_ptr<T>;
+
+      template<class T>
+      using weak = ::local_weak_ptr<T>;
+
+      template<class T, class... ParamTypes>
+      static shared<T> make(ParamTypes&&... i_params)
+      {
+         return ::make_local_shared<T>(std::forward<ParamTypes>(i_params)...);
+      }
+
+      template<class T, class Alloc, class... ParamTypes>
+      static shared<T> allocate(const Alloc& i_alloc, ParamTypes&&... i_params)
+      {
+         return ::allocate_local_shared<T>(i_alloc, std::forward<ParamTypes>(i_params)...);
+      }
+
+      template<class T, class Pointer>
+      static shared<T> dynamic_cast_to(Pointer&& i_ptr)
+      {
+         return ::dynamic_pointer_cast<T>(std::forward<Pointer>(i_ptr));
+      }
+   };
+
+   struct sharded_pointers
+   {
+      template<class T>
+      using shared = ::sharded_shared_ptr<T>;
+
+      template<class T>
+      using weak = ::sharded_weak_ptr<T>;
+
+      template<class T, class... ParamTypes>
+      static shared<T> make(ParamTypes&&... i_params)
+      {
+         return ::make_shared_sharded<T>(std::forward<ParamTypes>(i_params)...);
+      }
+   };
+
+   struct std_pointers
+   {
+      template<class T>
+      using shared = std::shared_ptr<T>;
+
+      template<class T>
+      using weak = std::weak_ptr<T>;
+
+      template<class T, class... ParamTypes>
+      static shared<T> make(ParamTypes&&... i_params)
+      {
+         return std::make_shared<T>(std::forward<ParamTypes>(i_params)...);
+      }
+
+      template<class T, class Alloc, class... ParamTypes>
+      static shared<T> allocate(const Alloc& i_alloc, ParamTypes&&... i_params)
+      {
+         return std::allocate_shared<T>(i_alloc, std::forward<ParamTypes>(i_params)...);
+      }
+
+      template<class T, class Pointer>
+      static shared<T> dynamic_cast_to(Pointer&& i_ptr)
+      {
+         return std::dynamic_pointer_cast<T>(std::forward<Pointer>(i_ptr));
+      }
+   };
+
+   // One object per pointer family shared by every thread of a benchmark run.
+   template<class Pointers>
+   typename Pointers::template shared<base>& shared_object()
+   {
+      static typename Pointers::template shared<base> object = Pointers::template make<derived>();
+      return object;
+   }
+
+   int max_threads()
+   {
+      return static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+   }
+
+   template<class Pointers>
+   void BM_Copy(benchmark::State& i_state)
+   {
+      auto& source = shared_object<Pointers>();
+      for (auto _ : i_state)
+      {
+         auto copy = source;
+         benchmark::DoNotOptimize(copy);
+      }
+      i_state.counters["pointer_bytes"] = benchmark::Counter(sizeof(source), benchmark::Counter::kAvgThreads);
+   }
+
+   template<class Pointers>
+   void BM_Move(benchmark::State& i_state)
+   {
+      auto first = shared_object<Pointers>();
+      decltype(first) second;
+      for (auto _ : i_state)
+      {
+         second = std::move(first);
+         first = std::move(second);
+         benchmark::DoNotOptimize(first);
+      }
+   }
+
+   template<class Pointers>
+   void BM_MakeShared(benchmark::State& i_state)
+   {
+      for (auto _ : i_state)
+      {
+         auto object = Pointers::template make<base>();
+         benchmark::DoNotOptimize(object);
+      }
+   }
+
+   template<class Pointers>
+   void BM_AllocateShared(benchmark::State& i_state)
+   {
+      std::allocator<base> alloc;
+      for (auto _ : i_state)
+      {
+         auto object = Pointers::template allocate<base>(alloc);
+         benchmark::DoNotOptimize(object);
+      }
+   }
+
+   template<class Pointers>
+   void BM_Reset(benchmark::State& i_state)
+   {
+      auto& source = shared_object<Pointers>();
+      for (auto _ : i_state)
+      {
+         auto copy = source;
+         copy.reset();
+         benchmark::DoNotOptimize(copy);
+      }
+   }
+
+   template<class Pointers>
+   void BM_WeakLock(benchmark::State& i_state)
+   {
+      typename Pointers::template weak<base> weak = shared_object<Pointers>();
+      for (auto _ : i_state)
+      {
+         auto locked = weak.lock();
+         benchmark::DoNotOptimize(locked);
+      }
+   }
+
+   template<class Pointers>
+   void BM_WeakLockExpired(benchmark::State& i_state)
+   {
+      typename Pointers::template weak<base> weak = Pointers::template make<base>();
+      for (auto _ : i_state)
+      {
+         auto locked = weak.lock();
+         benchmark::DoNotOptimize(locked);
+      }
+   }
+
+   template<class Pointers>
+   void BM_AliasingConstructor(benchmark::State& i_state)
+   {
+      auto& source = shared_object<Pointers>();
+      for (auto _ : i_state)
+      {
+         typename Pointers::template shared<int> aliased(source, &source->m_value);
+         benchmark::DoNotOptimize(aliased);
+      }
+   }
+
+   template<class Pointers>
+   void BM_DynamicPointerCast(benchmark::State& i_state)
+   {
+      auto& source = shared_object<Pointers>();
+      for (auto _ : i_state)
+      {
+         auto casted = Pointers::template dynamic_cast_to<derived>(source);
+         benchmark::DoNotOptimize(casted);
+      }
+   }
+
+   // A dispatcher that downcasts the message it was handed: the cast of the
+   // rvalue takes its reference over. std::dynamic_pointer_cast only has the
+   // rvalue overload from C++20 on and copies here.
+   template<class Pointers>
+   void BM_DispatchDowncast(benchmark::State& i_state)
+   {
+      auto& source = shared_object<Pointers>();
+      for (auto _ : i_state)
+      {
+         auto message = source;
+         auto handled = Pointers::template dynamic_cast_to<derived>(std::move(message));
+         benchmark::DoNotOptimize(handled);
+      }
+   }
+}
+
+// The local pointers are not thread safe, they only run on one thread.
+namespace
+{
+   // Creates and drops a batch of pointers, so that every control block is
+   // allocated and freed once per object. With pooled_base the blocks come
+   // from control_block_pool, with base from the global heap.
+   template<class T>
+   void BM_ControlBlockChurn(benchmark::State& i_state)
+   {
+      const std::size_t batchSize = static_cast<std::size_t>(i_state.range(0));
+      std::vector<shared_ptr<T>> pointers;
+      pointers.reserve(batchSize);
+      for (auto _ : i_state)
+      {
+         for (std::size_t i = 0; i < batchSize; i++) pointers.emplace_back(new T);
+         pointers.clear();
+      }
+      i_state.SetItemsProcessed(i_state.iterations() * batchSize);
+      i_state.counters["rss_kb"] = resident_set_kb();
+   }
+}
+
+// Object read on several cores while other threads copy the pointer to it.
+namespace
+{
+   struct hot_object
+   {
+      int m_values[8] = {};
+   };
+
+   struct make_shared_hot
+   {
+      static shared_ptr<hot_object> make()
+      {
+         return make_shared<hot_object>();
+      }
+   };
+
+   struct make_shared_padded_hot
+   {
+      static shared_ptr<hot_object> make()
+      {
+         return make_shared_padded<hot_object>();
+      }
+   };
+
+   struct std_make_shared_hot
+   {
+      static std::shared_ptr<hot_object> make()
+      {
+         return std::make_shared<hot_object>();
+      }
+   };
+
+   // Even threads copy the pointer, odd threads read the object. Without
+   // padding the object shares its first cache line with the reference
+   // counts, so every copy stalls the readers too.
+   template<class Maker>
+   void BM_HotObjectReadCopy(benchmark::State& i_state)
+   {
+      static auto source = Maker::make();
+      const bool reader = i_state.thread_index() % 2 != 0;
+      for (auto _ : i_state)
+      {
+         if (reader)
+         {
+            int sum = 0;
+            for (int value : source->m_values) sum += value;
+            benchmark::DoNotOptimize(sum);
+         }
+         else
+         {
+            auto copy = source;
+            benchmark::DoNotOptimize(copy);
+         }
+      }
+   }
+}
+
+// Readers loading a snapshot that is never replaced, from 1 to 64 threads.
+// std::shared_ptr is loaded through std::atomic_load, which libstdc++ and
+// the Microsoft STL implement with a lock.
+namespace
+{
+   void BM_AtomicSharedPtrLoad(benchmark::State& i_state)
+   {
+      static atomic_shared_ptr<base> snapshot(make_shared<base>());
+      for (auto _ : i_state)
+      {
+         auto loaded = snapshot.load();
+         benchmark::DoNotOptimize(loaded);
+      }
+   }
+
+   // Notifying an observer: locking the slot in place against copying the
+   // weak_ptr out of it first.
+   void BM_AtomicWeakPtrLock(benchmark::State& i_state)
+   {
+      static auto observer = make_shared<base>();
+      static atomic_weak_ptr<base> slot(observer);
+      for (auto _ : i_state)
+      {
+         auto locked = slot.lock();
+         benchmark::DoNotOptimize(locked);
+      }
+   }
+
+   void BM_AtomicWeakPtrLoadThenLock(benchmark::State& i_state)
+   {
+      static auto observer = make_shared<base>();
+      static atomic_weak_ptr<base> slot(observer);
+      for (auto _ : i_state)
+      {
+         auto locked = slot.load().lock();
+         benchmark::DoNotOptimize(locked);
+      }
+   }
+
+   // Reading the object behind a slot under an epoch guard, against taking
+   // a counted reference to it for the read.
+   void BM_EpochBorrow(benchmark::State& i_state)
+   {
+      static epoch_shared_ptr<base> slot(make_shared<base>());
+      for (auto _ : i_state)
+      {
+         epoch_guard guard;
+         auto borrowed = slot.borrow(guard);
+         benchmark::DoNotOptimize(borrowed->m_value);
+      }
+   }
+
+   void BM_CopyToRead(benchmark::State& i_state)
+   {
+      auto& source = shared_object<library_pointers>();
+      for (auto _ : i_state)
+      {
+         auto copy = source;
+         benchmark::DoNotOptimize(copy->m_value);
+      }
+   }
+
+   void BM_StdAtomicLoad(benchmark::State& i_state)
+   {
+      static std::shared_ptr<base> snapshot = std::make_shared<base>();
+      for (auto _ : i_state)
+      {
+         auto loaded = std::atomic_load(&snapshot);
+         benchmark::DoNotOptimize(loaded);
+      }
+   }
+}
+
+// Shared buffers: one allocation for the counts and the elements, against
+// the elements and the control block allocated separately.
+namespace
+{
+   void BM_MakeSharedArray(benchmark::State& i_state)
+   {
+      const std::size_t count = static_cast<std::size_t>(i_state.range(0));
+      for (auto _ : i_state)
+      {
+         auto buffer = make_shared_for_overwrite<float[]>(count);
+         benchmark::DoNotOptimize(buffer[0]);
+      }
+   }
+
+   void BM_SharedArrayFromNew(benchmark::State& i_state)
+   {
+      const std::size_t count = static_cast<std::size_t>(i_state.range(0));
+      for (auto _ : i_state)
+      {
+         shared_ptr<float[]> buffer(new float[count]);
+         benchmark::DoNotOptimize(buffer[0]);
+      }
+   }
+}
+
+// Large payloads: make_shared value initializes them, zeroing every byte
+// that the caller then overwrites anyway.
+namespace
+{
+   template<std::size_t Size>
+   struct pod_buffer
+   {
+      char m_bytes[Size];
+   };
+
+   template<std::size_t Size>
+   void BM_MakeSharedBuffer(benchmark::State& i_state)
+   {
+      for (auto _ : i_state)
+      {
+         auto buffer = make_shared<pod_buffer<Size>>();
+         benchmark::DoNotOptimize(buffer->m_bytes[0]);
+      }
+   }
+
+   template<std::size_t Size>
+   void BM_MakeSharedBufferForOverwrite(benchmark::State& i_state)
+   {
+      for (auto _ : i_state)
+      {
+         auto buffer = make_shared_for_overwrite<pod_buffer<Size>>();
+         benchmark::DoNotOptimize(buffer->m_bytes[0]);
+      }
+   }
+}
+
+// Counts kept in the object: the pointer is a raw pointer and there is no
+// control block, against BM_Copy of the shared_ptr families.
+namespace
+{
+   struct intrusive_object : public base, public intrusive_ref_counter<intrusive_object>
+   {
+   };
+
+   struct local_intrusive_object : public base, public intrusive_ref_counter<local_intrusive_object, local_ref_count>
+   {
+   };
+
+   template<class Object>
+   void BM_IntrusiveCopy(benchmark::State& i_state)
+   {
+      static intrusive_ptr<Object> source(new Object);
+      for (auto _ : i_state)
+      {
+         auto copy = source;
+         benchmark::DoNotOptimize(copy);
+      }
+      i_state.counters["pointer_bytes"] = benchmark::Counter(sizeof(source), benchmark::Counter::kAvgThreads);
+   }
+}
+
+// Containers of pointers: vector growth, sort and deque churn only move the
+// pointers, so none of them should touch the reference counts.
+namespace
+{
+   template<class Pointers>
+   std::vector<typename Pointers::template shared<base>> make_pool(std::size_t i_count)
+   {
+      std::mt19937 random(42);
+      std::vector<typename Pointers::template shared<base>> pool;
+      for (std::size_t i = 0; i < i_count; i++)
+      {
+         pool.push_back(Pointers::template make<derived>());
+         pool.back()->m_value = static_cast<int>(random());
+      }
+      return pool;
+   }
+
+   // The reallocations relocate the pointers already pushed.
+   template<class Pointers>
+   void BM_VectorGrowth(benchmark::State& i_state)
+   {
+      auto pool = make_pool<Pointers>(static_cast<std::size_t>(i_state.range(0)));
+      for (auto _ : i_state)
+      {
+         std::vector<typename Pointers::template shared<base>> grown;
+         for (auto& pointer : pool) grown.push_back(std::move(pointer));
+         pool.swap(grown);
+         benchmark::DoNotOptimize(pool.data());
+      }
+   }
+
+   template<class Pointers>
+   void BM_Sort(benchmark::State& i_state)
+   {
+      auto pool = make_pool<Pointers>(static_cast<std::size_t>(i_state.range(0)));
+      std::mt19937 random(42);
+      for (auto _ : i_state)
+      {
+         std::shuffle(pool.begin(), pool.end(), random);
+         std::sort(pool.begin(), pool.end(), [](const auto& i_lhs, const auto& i_rhs) { return i_lhs.get()->m_value < i_rhs.get()->m_value; });
+         benchmark::DoNotOptimize(pool.data());
+      }
+   }
+
+   // A queue that every element passes through once per iteration.
+   template<class Pointers>
+   void BM_DequeChurn(benchmark::State& i_state)
+   {
+      auto pool = make_pool<Pointers>(static_cast<std::size_t>(i_state.range(0)));
+      std::deque<typename Pointers::template shared<base>> queue(std::make_move_iterator(pool.begin()), std::make_move_iterator(pool.end()));
+      for (auto _ : i_state)
+      {
+         for (std::size_t i = 0; i < queue.size(); i++)
+         {
+            queue.push_back(std::move(queue.front()));
+            queue.pop_front();
+         }
+         benchmark::DoNotOptimize(queue.front());
+      }
+   }
+}
+
+// Relocation: a rehash or a reallocation moves every entry to new memory,
+// with one memcpy for trivially relocatable entries against a move and a
+// destruction per entry otherwise.
+namespace
+{
+   template<bool Relocate>
+   void BM_RehashEntries(benchmark::State& i_state)
+   {
+      using entry = std::pair<std::size_t, ::shared_ptr<base>>;
+      const std::size_t count = static_cast<std::size_t>(i_state.range(0));
+      entry* from = static_cast<entry*>(::operator new(count * sizeof(entry)));
+      entry* to = static_cast<entry*>(::operator new(count * sizeof(entry)));
+      auto& object = shared_object<library_pointers>();
+      for (std::size_t i = 0; i < count; i++) ::new (static_cast<void*>(from + i)) entry(i, object);
+      std::memset(static_cast<void*>(to), 0, count * sizeof(entry));
+
+      for (auto _ : i_state)
+      {
+         if (Relocate)
+         {
+            uninitialized_relocate(from, from + count, to);
+         }
+         else
+         {
+            for (std::size_t i = 0; i < count; i++)
+            {
+               ::new (static_cast<void*>(to + i)) entry(std::move(from[i]));
+               from[i].~entry();
+            }
+         }
+         std::swap(from, to);
+         benchmark::DoNotOptimize(from);
+      }
+      i_state.SetItemsProcessed(i_state.iterations() * count);
+
+      for (std::size_t i = 0; i < count; i++) from[i].~entry();
+      ::operator delete(from);
+      ::operator delete(to);
+   }
+
+   template<class Pointers>
+   void BM_SmallVectorGrowth(benchmark::State& i_state)
+   {
+      small_vector<typename Pointers::template shared<base>, 16> pool;
+      for (auto& pointer : make_pool<Pointers>(static_cast<std::size_t>(i_state.range(0)))) pool.push_back(std::move(pointer));
+      for (auto _ : i_state)
+      {
+         small_vector<typename Pointers::template shared<base>, 16> grown;
+         for (auto& pointer : pool) grown.push_back(std::move(pointer));
+         pool.swap(grown);
+         benchmark::DoNotOptimize(pool.data());
+      }
+   }
+}
+
+// Releasing the last owner per kind of control block: a trivially
+// destructible payload is freed with a single call, a payload with a
+// destructor runs it first; an empty deleter takes no room in its block.
+namespace
+{
+   struct delete_int
+   {
+      void operator()(int* i_pointer) const
+      {
+         delete i_pointer;
+      }
+   };
+
+   void delete_int_function(int* i_pointer)
+   {
+      delete i_pointer;
+   }
+
+   struct trivial_payload
+   {
+      static constexpr std::size_t s_blockSize = sizeof(control_block_element<int>);
+
+      static ::shared_ptr<void> make()
+      {
+         return ::make_shared<int>(1);
+      }
+   };
+
+   struct payload_with_destructor
+   {
+      static constexpr std::size_t s_blockSize = sizeof(control_block_element<std::string>);
+
+      static ::shared_ptr<void> make()
+      {
+         return ::make_shared<std::string>("payload");
+      }
+   };
+
+   struct empty_deleter
+   {
+      static constexpr std::size_t s_blockSize = sizeof(control_block_deleter<int, delete_int>);
+
+      static ::shared_ptr<void> make()
+      {
+         return ::shared_ptr<int>(new int(1), delete_int());
+      }
+   };
+
+   struct function_pointer_deleter
+   {
+      static constexpr std::size_t s_blockSize = sizeof(control_block_deleter<int, void(*)(int*)>);
+
+      static ::shared_ptr<void> make()
+      {
+         return ::shared_ptr<int>(new int(1), &delete_int_function);
+      }
+   };
+
+   template<class Block>
+   void BM_ReleaseLast(benchmark::State& i_state)
+   {
+      const std::size_t batchSize = static_cast<std::size_t>(i_state.range(0));
+      std::vector<::shared_ptr<void>> pointers;
+      pointers.reserve(batchSize);
+      for (auto _ : i_state)
+      {
+         i_state.PauseTiming();
+         for (std::size_t i = 0; i < batchSize; i++) pointers.push_back(Block::make());
+         i_state.ResumeTiming();
+         pointers.clear();
+      }
+      i_state.SetItemsProcessed(i_state.iterations() * batchSize);
+      i_state.counters["block_bytes"] = Block::s_blockSize;
+   }
+}
+
+#define SHARED_PTR_BENCHMARK(name) \
+   BENCHMARK_TEMPLATE(name, library_pointers)->ThreadRange(1, max_threads())->UseRealTime(); \
+   BENCHMARK_TEMPLATE(name, local_pointers)->UseRealTime(); \
+   BENCHMARK_TEMPLATE(name, std_pointers)->ThreadRange(1, max_threads())->UseRealTime()
+
+SHARED_PTR_BENCHMARK(BM_Copy);
+SHARED_PTR_BENCHMARK(BM_Move);
+SHARED_PTR_BENCHMARK(BM_MakeShared);
+SHARED_PTR_BENCHMARK(BM_AllocateShared);
+SHARED_PTR_BENCHMARK(BM_Reset);
+SHARED_PTR_BENCHMARK(BM_WeakLock);
+SHARED_PTR_BENCHMARK(BM_WeakLockExpired);
+SHARED_PTR_BENCHMARK(BM_AliasingConstructor);
+SHARED_PTR_BENCHMARK(BM_DynamicPointerCast);
+SHARED_PTR_BENCHMARK(BM_DispatchDowncast);
+
+BENCHMARK_TEMPLATE(BM_ControlBlockChurn, base)->Arg(1024)->Arg(65536)->ThreadRange(1, max_threads())->UseRealTime();
+BENCHMARK_TEMPLATE(BM_ControlBlockChurn, pooled_base)->Arg(1024)->Arg(65536)->ThreadRange(1, max_threads())->UseRealTime();
+
+BENCHMARK_TEMPLATE(BM_HotObjectReadCopy, make_shared_hot)->ThreadRange(2, std::max(2, max_threads()))->UseRealTime();
+BENCHMARK_TEMPLATE(BM_HotObjectReadCopy, make_shared_padded_hot)->ThreadRange(2, std::max(2, max_threads()))->UseRealTime();
+BENCHMARK_TEMPLATE(BM_HotObjectReadCopy, std_make_shared_hot)->ThreadRange(2, std::max(2, max_threads()))->UseRealTime();
+
+// Every thread copying the same pointer, the scaled up TestMultithreadingAccess.
+BENCHMARK_TEMPLATE(BM_Copy, sharded_pointers)->ThreadRange(1, std::max(32, max_threads()))->UseRealTime();
+BENCHMARK_TEMPLATE(BM_Copy, library_pointers)->ThreadRange(32, std::max(32, max_threads()))->UseRealTime();
+BENCHMARK_TEMPLATE(BM_WeakLock, sharded_pointers)->ThreadRange(1, std::max(32, max_threads()))->UseRealTime();
+
+BENCHMARK(BM_AtomicSharedPtrLoad)->ThreadRange(1, 64)->UseRealTime();
+BENCHMARK(BM_StdAtomicLoad)->ThreadRange(1, 64)->UseRealTime();
+BENCHMARK(BM_AtomicWeakPtrLock)->ThreadRange(1, 64)->UseRealTime();
+BENCHMARK(BM_AtomicWeakPtrLoadThenLock)->ThreadRange(1, 64)->UseRealTime();
+BENCHMARK(BM_EpochBorrow)->ThreadRange(1, 64)->UseRealTime();
+BENCHMARK(BM_CopyToRead)->ThreadRange(1, 64)->UseRealTime();
+
+BENCHMARK(BM_MakeSharedArray)->Arg(64)->Arg(4096)->UseRealTime();
+BENCHMARK(BM_SharedArrayFromNew)->Arg(64)->Arg(4096)->UseRealTime();
+
+BENCHMARK_TEMPLATE(BM_MakeSharedBuffer, 1024)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_MakeSharedBufferForOverwrite, 1024)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_MakeSharedBuffer, 4096)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_MakeSharedBufferForOverwrite, 4096)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_MakeSharedBuffer, 16384)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_MakeSharedBufferForOverwrite, 16384)->UseRealTime();
+
+BENCHMARK_TEMPLATE(BM_IntrusiveCopy, intrusive_object)->ThreadRange(1, max_threads())->UseRealTime();
+BENCHMARK_TEMPLATE(BM_IntrusiveCopy, local_intrusive_object)->UseRealTime();
+
+BENCHMARK_TEMPLATE(BM_VectorGrowth, library_pointers)->Arg(1 << 16)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_VectorGrowth, local_pointers)->Arg(1 << 16)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_VectorGrowth, std_pointers)->Arg(1 << 16)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_Sort, library_pointers)->Arg(1 << 16)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_Sort, local_pointers)->Arg(1 << 16)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_Sort, std_pointers)->Arg(1 << 16)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_DequeChurn, library_pointers)->Arg(1 << 16)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_DequeChurn, local_pointers)->Arg(1 << 16)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_DequeChurn, std_pointers)->Arg(1 << 16)->UseRealTime();
+
+BENCHMARK_TEMPLATE(BM_RehashEntries, true)->Arg(1 << 22)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_RehashEntries, false)->Arg(1 << 22)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_SmallVectorGrowth, library_pointers)->Arg(1 << 16)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_SmallVectorGrowth, std_pointers)->Arg(1 << 16)->UseRealTime();
+
+BENCHMARK_TEMPLATE(BM_ReleaseLast, trivial_payload)->Arg(4096)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_ReleaseLast, payload_with_destructor)->Arg(4096)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_ReleaseLast, empty_deleter)->Arg(4096)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_ReleaseLast, function_pointer_deleter)->Arg(4096)->UseRealTime();
+
+BENCHMARK_MAIN();
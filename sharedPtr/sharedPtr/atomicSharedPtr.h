@@ -0,0 +1,243 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <utility>
+
+#include "sharedPtr.h"
+
+// Storage for a shared_ptr or weak_ptr that threads can load, store, exchange
+// and compare-exchange concurrently, for values many threads read while few
+// threads replace them. No operation takes a lock.
+//
+// Every stored value lives in a node of its own. m_word packs the address of
+// the current node with the number of loads that borrowed it (split
+// reference counting):
+//  - a load borrows the node by incrementing the count in m_word, copies the
+//    pointer out of it and gives the borrow back by decrementing the count
+//    again, as long as the node is still the current one;
+//  - a writer that swaps a node out takes the borrows still counted in m_word
+//    over to the node's m_pendingLoads; loads that find their node swapped
+//    out decrement that count instead, and the last one deletes the node.
+// A load is one fetch_add and one compare-exchange on m_word plus the
+// increment of the pointer's own count. At most 2^16 - 1 loads may be in
+// flight at the same time on 64-bit targets.
+template<class Pointer>
+class basic_atomic_pointer
+{
+public:
+   basic_atomic_pointer() : m_word(0)
+   {
+   }
+
+   basic_atomic_pointer(Pointer i_desired) : m_word(pack(new_node(std::move(i_desired)), 0))
+   {
+   }
+
+   basic_atomic_pointer(const basic_atomic_pointer&) = delete;
+   basic_atomic_pointer& operator=(const basic_atomic_pointer&) = delete;
+
+   ~basic_atomic_pointer()
+   {
+      delete node_of(m_word.load(std::memory_order_relaxed));
+   }
+
+   operator Pointer() const
+   {
+      return load();
+   }
+
+   bool is_lock_free() const
+   {
+      return m_word.is_lock_free();
+   }
+
+   Pointer load() const
+   {
+      node* current = borrow();
+      Pointer value = current ? current->m_value : Pointer();
+      give_back(current);
+      return value;
+   }
+
+   void store(Pointer i_desired)
+   {
+      exchange(std::move(i_desired));
+   }
+
+   Pointer exchange(Pointer i_desired)
+   {
+      return retire(m_word.exchange(pack(new_node(std::move(i_desired)), 0), std::memory_order_acq_rel), 0);
+   }
+
+   // Stores i_desired if the current value shares ownership with i_expected
+   // and points to the same object, otherwise copies the current value to
+   // i_expected.
+   bool compare_exchange_strong(Pointer& i_expected, Pointer i_desired)
+   {
+      node* desired = new_node(std::move(i_desired));
+      for (;;)
+      {
+         node* current = borrow();
+         if (!holds(current, i_expected))
+         {
+            i_expected = current ? current->m_value : Pointer();
+            give_back(current);
+            delete desired;
+            return false;
+         }
+
+         std::uint64_t word = m_word.load(std::memory_order_relaxed);
+         while (node_of(word) == current)
+         {
+            if (m_word.compare_exchange_weak(word, pack(desired, 0), std::memory_order_acq_rel, std::memory_order_relaxed))
+            {
+               retire(word, 1);
+               return true;
+            }
+         }
+
+         // Replaced in the meantime, compare against the new value.
+         give_back(current);
+      }
+   }
+
+   bool compare_exchange_weak(Pointer& i_expected, Pointer i_desired)
+   {
+      return compare_exchange_strong(i_expected, std::move(i_desired));
+   }
+
+protected:
+   struct node
+   {
+      explicit node(Pointer&& i_value) : m_value(std::move(i_value))
+      {
+      }
+
+      Pointer m_value;
+      std::atomic<long> m_pendingLoads{ 0 };
+   };
+
+   // The node stays alive until the borrow is given back.
+   node* borrow() const
+   {
+      return node_of(m_word.fetch_add(s_oneBorrow, std::memory_order_acquire));
+   }
+
+   void give_back(node* i_node) const
+   {
+      std::uint64_t word = m_word.load(std::memory_order_relaxed);
+      while (node_of(word) == i_node && borrows_of(word) > 0)
+      {
+         if (m_word.compare_exchange_weak(word, word - s_oneBorrow, std::memory_order_release, std::memory_order_relaxed)) return;
+      }
+
+      // Swapped out, the writer moved this borrow over to the node.
+      if (i_node && i_node->m_pendingLoads.fetch_sub(1, std::memory_order_acq_rel) == 1) delete i_node;
+   }
+
+private:
+   // User space addresses leave the top 16 bits of a 64-bit pointer clear.
+   static const unsigned s_countShift = sizeof(void*) == 8 ? 48 : 32;
+   static const std::uint64_t s_oneBorrow = std::uint64_t(1) << s_countShift;
+
+   static std::uint64_t pack(node* i_node, std::uint64_t i_borrows)
+   {
+      return reinterpret_cast<std::uintptr_t>(i_node) | (i_borrows << s_countShift);
+   }
+
+   static node* node_of(std::uint64_t i_word)
+   {
+      return reinterpret_cast<node*>(static_cast<std::uintptr_t>(i_word & (s_oneBorrow - 1)));
+   }
+
+   static long borrows_of(std::uint64_t i_word)
+   {
+      return static_cast<long>(i_word >> s_countShift);
+   }
+
+   template<class T>
+   static T* pointer_of(const shared_ptr<T>& i_value)
+   {
+      return i_value.get();
+   }
+
+   template<class T>
+   static T* pointer_of(const weak_ptr<T>& i_value)
+   {
+      return i_value.get_ptr();
+   }
+
+   // Empty pointers are stored without a node.
+   static node* new_node(Pointer&& i_value)
+   {
+      if (!pointer_of(i_value) && !i_value.get_control_block()) return nullptr;
+      return new node(std::move(i_value));
+   }
+
+   static bool holds(node* i_node, const Pointer& i_value)
+   {
+      if (!i_node) return !pointer_of(i_value) && !i_value.get_control_block();
+      return pointer_of(i_node->m_value) == pointer_of(i_value) && i_node->m_value.get_control_block() == i_value.get_control_block();
+   }
+
+   // Takes over a word swapped out of m_word, of which i_ownBorrows borrows
+   // belong to the caller, and returns the value its node held.
+   static Pointer retire(std::uint64_t i_word, long i_ownBorrows)
+   {
+      node* retired = node_of(i_word);
+      if (!retired) return Pointer();
+
+      long borrows = borrows_of(i_word) - i_ownBorrows;
+      if (borrows == 0)
+      {
+         Pointer value = std::move(retired->m_value);
+         delete retired;
+         return value;
+      }
+
+      Pointer value = retired->m_value;
+      if (retired->m_pendingLoads.fetch_add(borrows, std::memory_order_acq_rel) + borrows == 0) delete retired;
+      return value;
+   }
+
+   mutable std::atomic<std::uint64_t> m_word;
+};
+
+template<class T>
+class atomic_shared_ptr : public basic_atomic_pointer<shared_ptr<T>>
+{
+public:
+   using basic_atomic_pointer<shared_ptr<T>>::basic_atomic_pointer;
+
+   atomic_shared_ptr& operator=(shared_ptr<T> i_desired)
+   {
+      this->store(std::move(i_desired));
+      return *this;
+   }
+};
+
+// Slot of a weak_ptr, for registries of observers that threads replace and
+// notify concurrently.
+template<class T>
+class atomic_weak_ptr : public basic_atomic_pointer<weak_ptr<T>>
+{
+public:
+   using basic_atomic_pointer<weak_ptr<T>>::basic_atomic_pointer;
+
+   atomic_weak_ptr& operator=(weak_ptr<T> i_desired)
+   {
+      this->store(std::move(i_desired));
+      return *this;
+   }
+
+   // Locks the weak_ptr in the slot where it is, with no weak_ptr copy and
+   // so no weak count round trip in between.
+   shared_ptr<T> lock() const noexcept
+   {
+      auto current = this->borrow();
+      shared_ptr<T> locked = current ? current->m_value.lock() : shared_ptr<T>();
+      this->give_back(current);
+      return locked;
+   }
+};
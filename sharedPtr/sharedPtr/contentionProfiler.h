@@ -0,0 +1,324 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// One reference count operation in SHARED_PTR_CONTENTION_SAMPLE_PERIOD is
+// timed per thread.
+#ifndef SHARED_PTR_CONTENTION_SAMPLE_PERIOD
+#define SHARED_PTR_CONTENTION_SAMPLE_PERIOD 1024
+#endif
+
+// Number of control blocks the profiler tells apart. A freed block gives its
+// slot back; past that, a new block takes the slot of the coldest one.
+#ifndef SHARED_PTR_CONTENTION_TABLE_SIZE
+#define SHARED_PTR_CONTENTION_TABLE_SIZE 4096
+#endif
+
+#if defined(_MSC_VER)
+#define SHARED_PTR_RETURN_ADDRESS() _ReturnAddress()
+#else
+#define SHARED_PTR_RETURN_ADDRESS() __builtin_return_address(0)
+#endif
+
+struct contention_call_site
+{
+   const void* m_address;
+   std::uint64_t m_samples;
+};
+
+struct contention_entry
+{
+   const void* m_controlBlock;
+   std::uint64_t m_samples;
+   std::uint64_t m_totalTicks;
+   std::uint64_t m_maxTicks;
+   // The call sites that sampled the block most, most frequent first.
+   std::vector<contention_call_site> m_callSites;
+};
+
+// Sampling profiler of the read-modify-writes on the reference counts, for
+// finding the shared objects whose counts bounce between cores. Filled in
+// by the control blocks when SHARED_PTR_CONTENTION_PROFILER is 1:
+//  - every thread times one count operation in
+//    SHARED_PTR_CONTENTION_SAMPLE_PERIOD, a read-modify-write slowed down
+//    by a cache line that other cores keep taking away;
+//  - samples are attributed to the control block and to the return address
+//    of the function the count operation was inlined into, and kept in a
+//    table of fixed size, so the memory and the time spent stay bounded;
+//  - a block gives its slot back when it is freed.
+// Ticks are time stamp counter cycles on x86 and steady_clock nanoseconds
+// elsewhere.
+class contention_profiler
+{
+public:
+   static std::uint64_t now()
+   {
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+      return __rdtsc();
+#else
+      return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+   }
+
+   // True once every SHARED_PTR_CONTENTION_SAMPLE_PERIOD calls on a thread.
+   static bool should_sample()
+   {
+      if (--t_countdown != 0) return false;
+
+      t_countdown = SHARED_PTR_CONTENTION_SAMPLE_PERIOD;
+      return true;
+   }
+
+   // Runs i_operation and records how long it took.
+   template<class Operation>
+   static auto timed(const void* i_controlBlock, const void* i_callSite, Operation i_operation)
+   {
+      std::uint64_t start = now();
+      if constexpr (std::is_void<decltype(i_operation())>::value)
+      {
+         i_operation();
+         record(i_controlBlock, i_callSite, now() - start);
+      }
+      else
+      {
+         auto result = i_operation();
+         record(i_controlBlock, i_callSite, now() - start);
+         return result;
+      }
+   }
+
+   static void record(const void* i_controlBlock, const void* i_callSite, std::uint64_t i_ticks)
+   {
+      std::size_t index = find_or_claim(reinterpret_cast<std::uintptr_t>(i_controlBlock));
+      if (index == s_none)
+      {
+         s_dropped.fetch_add(1, std::memory_order_relaxed);
+         return;
+      }
+
+      entry* slot = &table()[index];
+      slot->m_samples.fetch_add(1, std::memory_order_relaxed);
+      slot->m_totalTicks.fetch_add(i_ticks, std::memory_order_relaxed);
+      std::uint64_t max = slot->m_maxTicks.load(std::memory_order_relaxed);
+      while (i_ticks > max && !slot->m_maxTicks.compare_exchange_weak(max, i_ticks, std::memory_order_relaxed))
+      {
+      }
+
+      std::uintptr_t callSite = reinterpret_cast<std::uintptr_t>(i_callSite);
+      for (auto& site : slot->m_callSites)
+      {
+         std::uintptr_t address = site.m_address.load(std::memory_order_relaxed);
+         if (address == 0 && site.m_address.compare_exchange_strong(address, callSite, std::memory_order_relaxed)) address = callSite;
+         if (address == callSite)
+         {
+            site.m_samples.fetch_add(1, std::memory_order_relaxed);
+            return;
+         }
+      }
+      slot->m_otherSites.fetch_add(1, std::memory_order_relaxed);
+   }
+
+   // The i_count blocks on which the sampled operations spent the most
+   // ticks, the hottest first.
+   static std::vector<contention_entry> report(std::size_t i_count = 10)
+   {
+      std::vector<contention_entry> entries;
+      for (std::size_t index = 0; index < SHARED_PTR_CONTENTION_TABLE_SIZE; index++)
+      {
+         std::uintptr_t block = keys()[index].load(std::memory_order_acquire);
+         if (block == 0 || block == s_busy) continue;
+
+         entry& slot = table()[index];
+         contention_entry result{ reinterpret_cast<const void*>(block), slot.m_samples.load(std::memory_order_relaxed), slot.m_totalTicks.load(std::memory_order_relaxed), slot.m_maxTicks.load(std::memory_order_relaxed), {} };
+         for (auto& site : slot.m_callSites)
+         {
+            std::uintptr_t address = site.m_address.load(std::memory_order_relaxed);
+            if (address != 0) result.m_callSites.push_back(contention_call_site{ reinterpret_cast<const void*>(address), site.m_samples.load(std::memory_order_relaxed) });
+         }
+         std::uint64_t otherSites = slot.m_otherSites.load(std::memory_order_relaxed);
+         if (otherSites != 0) result.m_callSites.push_back(contention_call_site{ nullptr, otherSites });
+         std::sort(result.m_callSites.begin(), result.m_callSites.end(), [](const contention_call_site& i_lhs, const contention_call_site& i_rhs) { return i_lhs.m_samples > i_rhs.m_samples; });
+         entries.push_back(std::move(result));
+      }
+
+      std::sort(entries.begin(), entries.end(), [](const contention_entry& i_lhs, const contention_entry& i_rhs) { return i_lhs.m_totalTicks > i_rhs.m_totalTicks; });
+      if (entries.size() > i_count) entries.resize(i_count);
+      return entries;
+   }
+
+   static std::string to_text(const std::vector<contention_entry>& i_entries)
+   {
+      std::string text;
+      char line[160];
+      std::snprintf(line, sizeof(line), "sample period %d, %llu samples dropped\n", SHARED_PTR_CONTENTION_SAMPLE_PERIOD, static_cast<unsigned long long>(dropped()));
+      text += line;
+      for (const auto& entry : i_entries)
+      {
+         std::snprintf(line, sizeof(line), "block %p: %llu samples, %llu ticks, mean %llu, max %llu\n", entry.m_controlBlock, static_cast<unsigned long long>(entry.m_samples), static_cast<unsigned long long>(entry.m_totalTicks),
+            static_cast<unsigned long long>(entry.m_samples ? entry.m_totalTicks / entry.m_samples : 0), static_cast<unsigned long long>(entry.m_maxTicks));
+         text += line;
+         for (const auto& site : entry.m_callSites)
+         {
+            if (site.m_address) std::snprintf(line, sizeof(line), "   %p: %llu samples\n", site.m_address, static_cast<unsigned long long>(site.m_samples));
+            else std::snprintf(line, sizeof(line), "   other call sites: %llu samples\n", static_cast<unsigned long long>(site.m_samples));
+            text += line;
+         }
+      }
+      return text;
+   }
+
+   static std::uint64_t dropped()
+   {
+      return s_dropped.load(std::memory_order_relaxed);
+   }
+
+   // Frees the slot of a block that goes away, for the blocks allocated
+   // after it.
+   static void forget(const void* i_controlBlock)
+   {
+      std::uintptr_t block = reinterpret_cast<std::uintptr_t>(i_controlBlock);
+      std::size_t home = home_of(block);
+      for (std::size_t probe = 0; probe < s_maxProbes; probe++)
+      {
+         std::size_t index = (home + probe) % SHARED_PTR_CONTENTION_TABLE_SIZE;
+         if (keys()[index].load(std::memory_order_relaxed) == block && take(index, block, 0)) return;
+      }
+   }
+
+   // Forgets every sample. Samples recorded concurrently may be lost.
+   static void reset()
+   {
+      for (std::size_t index = 0; index < SHARED_PTR_CONTENTION_TABLE_SIZE; index++)
+      {
+         clear(table()[index]);
+         keys()[index].store(0, std::memory_order_release);
+      }
+      s_dropped.store(0, std::memory_order_relaxed);
+   }
+
+private:
+   static const std::size_t s_callSitesPerBlock = 4;
+   static const std::size_t s_maxProbes = 16;
+
+   struct call_site
+   {
+      std::atomic<std::uintptr_t> m_address{ 0 };
+      std::atomic<std::uint64_t> m_samples{ 0 };
+   };
+
+   struct entry
+   {
+      std::atomic<std::uint64_t> m_samples{ 0 };
+      std::atomic<std::uint64_t> m_totalTicks{ 0 };
+      std::atomic<std::uint64_t> m_maxTicks{ 0 };
+      std::atomic<std::uint64_t> m_otherSites{ 0 };
+      call_site m_callSites[s_callSitesPerBlock];
+   };
+
+   // Key of a slot that is being cleared for another block.
+   static const std::uintptr_t s_busy = 1;
+   static const std::size_t s_none = SHARED_PTR_CONTENTION_TABLE_SIZE;
+
+   static std::size_t home_of(std::uintptr_t i_block)
+   {
+      return static_cast<std::size_t>((i_block >> 4) * 0x9E3779B97F4A7C15ull >> 32);
+   }
+
+   static void clear(entry& i_slot)
+   {
+      i_slot.m_samples.store(0, std::memory_order_relaxed);
+      i_slot.m_totalTicks.store(0, std::memory_order_relaxed);
+      i_slot.m_maxTicks.store(0, std::memory_order_relaxed);
+      i_slot.m_otherSites.store(0, std::memory_order_relaxed);
+      for (auto& site : i_slot.m_callSites)
+      {
+         site.m_address.store(0, std::memory_order_relaxed);
+         site.m_samples.store(0, std::memory_order_relaxed);
+      }
+   }
+
+   // Hands the slot of i_owner over to i_block, 0 to free it. Samples that
+   // reach the slot while it changes hands may go to either block.
+   static bool take(std::size_t i_index, std::uintptr_t i_owner, std::uintptr_t i_block)
+   {
+      if (!keys()[i_index].compare_exchange_strong(i_owner, s_busy, std::memory_order_acquire, std::memory_order_relaxed)) return false;
+
+      clear(table()[i_index]);
+      keys()[i_index].store(i_block, std::memory_order_release);
+      return true;
+   }
+
+   // Open addressing on the block address, over keys kept apart from the
+   // samples so that the probes of a lookup share a couple of cache lines.
+   // Freed blocks give their slot back, so the probes do not stop at the
+   // first free slot. When they find neither the block nor a free slot, the
+   // block takes over the slot that spent the fewest ticks: a block sampled
+   // once no longer keeps a hot one out. Two threads sampling a new block at
+   // once may split it over two slots.
+   static std::size_t find_or_claim(std::uintptr_t i_block)
+   {
+      std::size_t home = home_of(i_block);
+      std::size_t unused = s_none;
+      std::size_t coldest = s_none;
+      std::uint64_t coldestTicks = 0;
+      for (std::size_t probe = 0; probe < s_maxProbes; probe++)
+      {
+         std::size_t index = (home + probe) % SHARED_PTR_CONTENTION_TABLE_SIZE;
+         std::uintptr_t block = keys()[index].load(std::memory_order_acquire);
+         if (block == i_block) return index;
+         if (block == 0)
+         {
+            if (unused == s_none) unused = index;
+         }
+         else if (block != s_busy)
+         {
+            std::uint64_t ticks = table()[index].m_totalTicks.load(std::memory_order_relaxed);
+            if (coldest == s_none || ticks < coldestTicks)
+            {
+               coldest = index;
+               coldestTicks = ticks;
+            }
+         }
+      }
+
+      if (unused != s_none && take(unused, 0, i_block)) return unused;
+      if (coldest != s_none)
+      {
+         std::uintptr_t owner = keys()[coldest].load(std::memory_order_relaxed);
+         if (owner != 0 && owner != s_busy && take(coldest, owner, i_block)) return coldest;
+      }
+      return s_none;
+   }
+
+   // Never destroyed, like table().
+   static std::array<std::atomic<std::uintptr_t>, SHARED_PTR_CONTENTION_TABLE_SIZE>& keys()
+   {
+      static auto& instance = *new std::array<std::atomic<std::uintptr_t>, SHARED_PTR_CONTENTION_TABLE_SIZE>();
+      return instance;
+   }
+
+   // Never destroyed: counts may be released during static destruction.
+   static std::array<entry, SHARED_PTR_CONTENTION_TABLE_SIZE>& table()
+   {
+      static auto& instance = *new std::array<entry, SHARED_PTR_CONTENTION_TABLE_SIZE>;
+      return instance;
+   }
+
+   static inline std::atomic<std::uint64_t> s_dropped{ 0 };
+   static inline thread_local std::uint32_t t_countdown = SHARED_PTR_CONTENTION_SAMPLE_PERIOD;
+};
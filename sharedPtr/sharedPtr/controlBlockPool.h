@@ -0,0 +1,328 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <vector>
+
+// Thread caching pool for small, same sized allocations such as control
+// blocks. Memory is carved from slabs owned by one thread:
+//  - every thread keeps a free list per size class and allocates from it
+//    without synchronization;
+//  - a block freed by the owner of its slab goes back to that free list, a
+//    block freed on any other thread is pushed onto the owner's lock-free
+//    remote free list, which the owner drains once its own list runs dry;
+//  - free lists that grow too long hand batches of blocks to a global depot,
+//    from which other threads refill before carving new slabs.
+// Slabs are never returned to the system. The state of an exiting thread is
+// parked in the depot and adopted by the next thread that starts using the
+// pool, so blocks freed after their owner exited are not lost.
+class control_block_pool
+{
+public:
+   static const std::size_t s_granularity = 16;
+   static const std::size_t s_sizeClassCount = 16;
+   static const std::size_t s_maxSize = s_granularity * s_sizeClassCount;
+
+   static bool is_pooled(std::size_t i_size, std::size_t i_alignment = alignof(std::max_align_t))
+   {
+      return i_size <= s_maxSize && i_alignment <= s_granularity;
+   }
+
+   static void* allocate(std::size_t i_size)
+   {
+      if (!is_pooled(i_size)) return ::operator new(i_size);
+
+      std::size_t sizeClass = size_class(i_size);
+      if (thread_state* state = local_state())
+      {
+         return state->m_caches[sizeClass].pop(state, sizeClass);
+      }
+
+      // The thread's own state is already gone, fall back to the shared one.
+      std::lock_guard<std::mutex> lock(get_depot().m_mutex);
+      thread_state* state = get_depot().m_orphanState;
+      return state->m_caches[sizeClass].pop(state, sizeClass, false);
+   }
+
+   static void deallocate(void* i_pointer, std::size_t i_size)
+   {
+      if (!is_pooled(i_size))
+      {
+         ::operator delete(i_pointer);
+         return;
+      }
+
+      free_node* node = static_cast<free_node*>(i_pointer);
+      slab_header* slab = slab_of(node);
+      thread_state* state = local_state();
+      if (state && slab->m_owner == state)
+      {
+         state->m_caches[slab->m_sizeClass].push(node);
+      }
+      else
+      {
+         slab->m_owner->m_caches[slab->m_sizeClass].push_remote(node);
+      }
+   }
+
+private:
+   static const std::size_t s_slabSize = 64 * 1024;
+   static const std::size_t s_batchSize = 32;
+
+   struct free_node
+   {
+      free_node* m_next;
+   };
+
+   struct thread_state;
+
+   struct slab_header
+   {
+      thread_state* m_owner;
+      std::size_t m_sizeClass;
+   };
+
+   struct size_class_cache
+   {
+      void* pop(thread_state* i_owner, std::size_t i_sizeClass, bool i_useDepot = true)
+      {
+         if (!m_freeList) refill(i_owner, i_sizeClass, i_useDepot);
+
+         free_node* node = m_freeList;
+         m_freeList = node->m_next;
+         --m_freeCount;
+         return node;
+      }
+
+      void push(free_node* i_node)
+      {
+         i_node->m_next = m_freeList;
+         m_freeList = i_node;
+         if (++m_freeCount >= 2 * s_batchSize) flush_batch();
+      }
+
+      void push_remote(free_node* i_node)
+      {
+         free_node* head = m_remoteFree.load(std::memory_order_relaxed);
+         do
+         {
+            i_node->m_next = head;
+         } while (!m_remoteFree.compare_exchange_weak(head, i_node, std::memory_order_release, std::memory_order_relaxed));
+      }
+
+      void refill(thread_state* i_owner, std::size_t i_sizeClass, bool i_useDepot)
+      {
+         // The owner takes the whole remote list at once, so no ABA problem.
+         if (free_node* remote = m_remoteFree.exchange(nullptr, std::memory_order_acquire))
+         {
+            take_list(remote);
+            return;
+         }
+
+         if (i_useDepot)
+         {
+            std::lock_guard<std::mutex> lock(get_depot().m_mutex);
+            if (take_batch(i_sizeClass)) return;
+         }
+         else if (take_batch(i_sizeClass))
+         {
+            return;
+         }
+
+         carve_batch(i_owner, i_sizeClass);
+      }
+
+      bool take_batch(std::size_t i_sizeClass)
+      {
+         auto& batches = get_depot().m_batches[i_sizeClass];
+         if (batches.empty()) return false;
+
+         take_list(batches.back());
+         batches.pop_back();
+         return true;
+      }
+
+      void take_list(free_node* i_list)
+      {
+         m_freeList = i_list;
+         m_freeCount = 0;
+         for (free_node* node = i_list; node; node = node->m_next) ++m_freeCount;
+      }
+
+      // Carves the next batch of blocks out of the slab being consumed,
+      // starting a new slab once it is used up.
+      void carve_batch(thread_state* i_owner, std::size_t i_sizeClass)
+      {
+         std::size_t blockSize = (i_sizeClass + 1) * s_granularity;
+         if (static_cast<std::size_t>(m_slabEnd - m_slabNext) < blockSize)
+         {
+            void* memory = std::aligned_alloc(s_slabSize, s_slabSize);
+            if (!memory) throw std::bad_alloc();
+
+            ::new (memory) slab_header{ i_owner, i_sizeClass };
+            m_slabNext = static_cast<char*>(memory) + round_up(sizeof(slab_header));
+            m_slabEnd = static_cast<char*>(memory) + s_slabSize;
+         }
+
+         for (std::size_t i = 0; i < s_batchSize && static_cast<std::size_t>(m_slabEnd - m_slabNext) >= blockSize; i++)
+         {
+            free_node* node = reinterpret_cast<free_node*>(m_slabNext);
+            node->m_next = m_freeList;
+            m_freeList = node;
+            ++m_freeCount;
+            m_slabNext += blockSize;
+         }
+      }
+
+      void flush_batch()
+      {
+         free_node* batch = m_freeList;
+         free_node* last = batch;
+         for (std::size_t i = 1; i < s_batchSize; i++) last = last->m_next;
+         m_freeList = last->m_next;
+         last->m_next = nullptr;
+         m_freeCount -= s_batchSize;
+
+         std::lock_guard<std::mutex> lock(get_depot().m_mutex);
+         get_depot().m_batches[slab_of(batch)->m_sizeClass].push_back(batch);
+      }
+
+      void flush_all(std::size_t i_sizeClass)
+      {
+         while (m_freeCount >= s_batchSize) flush_batch();
+         if (!m_freeList) return;
+
+         std::lock_guard<std::mutex> lock(get_depot().m_mutex);
+         get_depot().m_batches[i_sizeClass].push_back(m_freeList);
+         m_freeList = nullptr;
+         m_freeCount = 0;
+      }
+
+      free_node* m_freeList = nullptr;
+      std::size_t m_freeCount = 0;
+      char* m_slabNext = nullptr;
+      char* m_slabEnd = nullptr;
+      std::atomic<free_node*> m_remoteFree{ nullptr };
+   };
+
+   struct thread_state
+   {
+      size_class_cache m_caches[s_sizeClassCount];
+   };
+
+   struct depot
+   {
+      std::mutex m_mutex;
+      std::vector<free_node*> m_batches[s_sizeClassCount];
+      std::vector<thread_state*> m_parkedStates;
+      thread_state* m_orphanState = new thread_state;
+   };
+
+   // Owns the pool state of one thread for the lifetime of that thread.
+   struct thread_state_holder
+   {
+      thread_state_holder()
+      {
+         std::lock_guard<std::mutex> lock(get_depot().m_mutex);
+         auto& parked = get_depot().m_parkedStates;
+         if (parked.empty())
+         {
+            m_state = new thread_state;
+         }
+         else
+         {
+            m_state = parked.back();
+            parked.pop_back();
+         }
+      }
+
+      ~thread_state_holder()
+      {
+         for (std::size_t i = 0; i < s_sizeClassCount; i++) m_state->m_caches[i].flush_all(i);
+
+         std::lock_guard<std::mutex> lock(get_depot().m_mutex);
+         get_depot().m_parkedStates.push_back(m_state);
+         t_stateDestroyed = true;
+      }
+
+      thread_state* m_state;
+   };
+
+   static thread_state* local_state()
+   {
+      if (t_stateDestroyed) return nullptr;
+      thread_local thread_state_holder holder;
+      return holder.m_state;
+   }
+
+   // Never destroyed: blocks may be freed during static destruction.
+   static depot& get_depot()
+   {
+      static depot* instance = new depot;
+      return *instance;
+   }
+
+   static std::size_t round_up(std::size_t i_size)
+   {
+      return (i_size + s_granularity - 1) / s_granularity * s_granularity;
+   }
+
+   static std::size_t size_class(std::size_t i_size)
+   {
+      return i_size == 0 ? 0 : round_up(i_size) / s_granularity - 1;
+   }
+
+   static slab_header* slab_of(free_node* i_node)
+   {
+      return reinterpret_cast<slab_header*>(reinterpret_cast<std::uintptr_t>(i_node) & ~(s_slabSize - 1));
+   }
+
+   static inline thread_local bool t_stateDestroyed = false;
+};
+
+// Standard allocator drawing from control_block_pool, for allocate_shared and
+// the allocator taking shared_ptr constructors.
+template<class T>
+struct control_block_pool_allocator
+{
+   using value_type = T;
+
+   control_block_pool_allocator() = default;
+
+   template<class TOther>
+   control_block_pool_allocator(const control_block_pool_allocator<TOther>&)
+   {
+   }
+
+   T* allocate(std::size_t i_count)
+   {
+      if (!control_block_pool::is_pooled(i_count * sizeof(T), alignof(T))) return static_cast<T*>(::operator new(i_count * sizeof(T)));
+      return static_cast<T*>(control_block_pool::allocate(i_count * sizeof(T)));
+   }
+
+   void deallocate(T* i_pointer, std::size_t i_count)
+   {
+      if (!control_block_pool::is_pooled(i_count * sizeof(T), alignof(T)))
+      {
+         ::operator delete(i_pointer);
+         return;
+      }
+      control_block_pool::deallocate(i_pointer, i_count * sizeof(T));
+   }
+};
+
+template<class T, class TOther>
+bool operator==(const control_block_pool_allocator<T>&, const control_block_pool_allocator<TOther>&)
+{
+   return true;
+}
+
+template<class T, class TOther>
+bool operator!=(const control_block_pool_allocator<T>&, const control_block_pool_allocator<TOther>&)
+{
+   return false;
+}
@@ -0,0 +1,292 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "sharedPtr.h"
+
+// Epoch based reclamation, for readers that access shared objects without
+// touching their reference counts:
+//  - a reader pins the current global epoch for the lifetime of an
+//    epoch_guard, by writing it to a record of its own thread;
+//  - a writer that unlinks an object retires it with the epoch of the moment
+//    it was unlinked, instead of releasing it;
+//  - a retired object is freed once every pinned epoch is newer than its
+//    own, since readers that pinned later cannot have seen it.
+// Readers only write to their own record, so they do not contend with each
+// other however many there are.
+class epoch_domain
+{
+public:
+   // Frees what no reader can reach any more and advances the epoch if every
+   // reader caught up with it. Retiring does this too; call it directly to
+   // flush the retired objects once the readers are gone.
+   static void reclaim()
+   {
+      std::vector<retired> freed;
+      {
+         std::lock_guard<std::mutex> lock(get_state().m_mutex);
+         collect(freed);
+      }
+      for (auto& object : freed) object.m_delete(object.m_pointer);
+   }
+
+   // Deletes i_pointer once no reader that might have seen it is pinned.
+   template<class T>
+   static void retire(T* i_pointer)
+   {
+      if (!i_pointer) return;
+
+      // Orders the unlinking before reading the epoch: a reader that saw
+      // the object pinned this epoch or an older one.
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      std::vector<retired> freed;
+      {
+         std::lock_guard<std::mutex> lock(get_state().m_mutex);
+         get_state().m_retired.push_back(retired{ s_globalEpoch.load(), i_pointer, &delete_object<T> });
+         collect(freed);
+      }
+      for (auto& object : freed) object.m_delete(object.m_pointer);
+   }
+
+private:
+   friend class epoch_guard;
+
+   struct thread_record
+   {
+      std::atomic<std::uint64_t> m_epoch{ 0 };
+      std::atomic<bool> m_inUse{ true };
+      unsigned m_nesting = 0;
+      thread_record* m_next = nullptr;
+   };
+
+   struct retired
+   {
+      std::uint64_t m_epoch;
+      void* m_pointer;
+      void (*m_delete)(void*);
+   };
+
+   struct state
+   {
+      std::mutex m_mutex;
+      std::vector<retired> m_retired;
+   };
+
+   // Records are reused by later threads, never freed.
+   struct thread_record_holder
+   {
+      thread_record_holder()
+      {
+         for (thread_record* record = s_records.load(std::memory_order_acquire); record; record = record->m_next)
+         {
+            bool inUse = false;
+            if (record->m_inUse.compare_exchange_strong(inUse, true, std::memory_order_acquire))
+            {
+               m_record = record;
+               return;
+            }
+         }
+
+         m_record = new thread_record;
+         m_record->m_next = s_records.load(std::memory_order_relaxed);
+         while (!s_records.compare_exchange_weak(m_record->m_next, m_record, std::memory_order_release, std::memory_order_relaxed))
+         {
+         }
+      }
+
+      ~thread_record_holder()
+      {
+         m_record->m_inUse.store(false, std::memory_order_release);
+      }
+
+      thread_record* m_record;
+   };
+
+   static thread_record& local_record()
+   {
+      thread_local thread_record_holder holder;
+      return *holder.m_record;
+   }
+
+   static void enter()
+   {
+      thread_record& record = local_record();
+      if (record.m_nesting++ > 0) return;
+
+      record.m_epoch.store(s_globalEpoch.load(), std::memory_order_relaxed);
+      // The pin must be visible before anything the reader loads next.
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+   }
+
+   static void leave()
+   {
+      thread_record& record = local_record();
+      if (--record.m_nesting > 0) return;
+
+      record.m_epoch.store(0, std::memory_order_release);
+   }
+
+   // Moves the objects that can be freed to o_freed. Called with the mutex
+   // held; the objects are deleted after it is released, since their
+   // destructors may retire more objects.
+   static void collect(std::vector<retired>& o_freed)
+   {
+      // Pairs with the fence of enter(), so every pin made before the
+      // objects were unlinked is seen.
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      std::uint64_t current = s_globalEpoch.load();
+      std::uint64_t oldestPinned = current + 1;
+      bool allCurrent = true;
+      for (thread_record* record = s_records.load(std::memory_order_acquire); record; record = record->m_next)
+      {
+         std::uint64_t epoch = record->m_epoch.load(std::memory_order_acquire);
+         if (epoch == 0) continue;
+
+         oldestPinned = std::min(oldestPinned, epoch);
+         if (epoch != current) allCurrent = false;
+      }
+      if (allCurrent) s_globalEpoch.compare_exchange_strong(current, current + 1);
+
+      auto& pending = get_state().m_retired;
+      auto stillPinned = std::partition(pending.begin(), pending.end(), [oldestPinned](const retired& i_object) { return i_object.m_epoch >= oldestPinned; });
+      o_freed.assign(stillPinned, pending.end());
+      pending.erase(stillPinned, pending.end());
+   }
+
+   template<class T>
+   static void delete_object(void* i_pointer)
+   {
+      delete static_cast<T*>(i_pointer);
+   }
+
+   // Never destroyed: objects may be retired during static destruction.
+   static state& get_state()
+   {
+      static state* instance = new state;
+      return *instance;
+   }
+
+   static inline std::atomic<std::uint64_t> s_globalEpoch{ 1 };
+   static inline std::atomic<thread_record*> s_records{ nullptr };
+};
+
+// Pins the current epoch: nothing retired from now on is freed before the
+// guard is destroyed. Guards nest.
+class epoch_guard
+{
+public:
+   epoch_guard()
+   {
+      epoch_domain::enter();
+   }
+
+   ~epoch_guard()
+   {
+      epoch_domain::leave();
+   }
+
+   epoch_guard(const epoch_guard&) = delete;
+   epoch_guard& operator=(const epoch_guard&) = delete;
+};
+
+// Pointer to an object kept alive by an epoch_guard rather than by a
+// reference count. It must not outlive the guard it was borrowed under;
+// to_shared() turns it into an owning pointer that may.
+template<class T>
+class borrowed_ptr
+{
+public:
+   borrowed_ptr() = default;
+
+   explicit borrowed_ptr(const shared_ptr<T>* i_owner) : m_pointer(i_owner ? i_owner->get() : nullptr), m_owner(i_owner)
+   {
+   }
+
+   T* get() const
+   {
+      return m_pointer;
+   }
+
+   T& operator*() const
+   {
+      return *m_pointer;
+   }
+
+   T* operator->() const
+   {
+      return m_pointer;
+   }
+
+   explicit operator bool() const
+   {
+      return m_pointer != nullptr;
+   }
+
+   shared_ptr<T> to_shared() const
+   {
+      return m_owner ? *m_owner : shared_ptr<T>();
+   }
+
+private:
+   T* m_pointer = nullptr;
+   const shared_ptr<T>* m_owner = nullptr;
+};
+
+// A shared_ptr slot that readers access through borrowed_ptr without
+// touching the reference counts. Writers store ordinary shared_ptrs; the
+// reference the slot held is dropped through epoch_domain, so the object is
+// destroyed once its last owner is gone and no reader borrows it any more.
+template<class T>
+class epoch_shared_ptr
+{
+public:
+   epoch_shared_ptr() = default;
+
+   explicit epoch_shared_ptr(shared_ptr<T> i_desired) : m_node(new_node(std::move(i_desired)))
+   {
+   }
+
+   epoch_shared_ptr(const epoch_shared_ptr&) = delete;
+   epoch_shared_ptr& operator=(const epoch_shared_ptr&) = delete;
+
+   ~epoch_shared_ptr()
+   {
+      epoch_domain::retire(m_node.load(std::memory_order_relaxed));
+   }
+
+   borrowed_ptr<T> borrow(const epoch_guard&) const
+   {
+      node* current = m_node.load(std::memory_order_acquire);
+      return borrowed_ptr<T>(current ? &current->m_value : nullptr);
+   }
+
+   shared_ptr<T> load() const
+   {
+      epoch_guard guard;
+      return borrow(guard).to_shared();
+   }
+
+   void store(shared_ptr<T> i_desired)
+   {
+      epoch_domain::retire(m_node.exchange(new_node(std::move(i_desired)), std::memory_order_acq_rel));
+   }
+
+private:
+   struct node
+   {
+      shared_ptr<T> m_value;
+   };
+
+   static node* new_node(shared_ptr<T>&& i_value)
+   {
+      if (!i_value.get() && !i_value.get_control_block()) return nullptr;
+      return new node{ std::move(i_value) };
+   }
+
+   std::atomic<node*> m_node{ nullptr };
+};
@@ -0,0 +1,402 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <type_traits>
+#include <utility>
+
+#include "sharedPtr.h"
+
+// Pointer to an object that keeps its reference count itself, for node types
+// that would rather not pay for a control block and a second pointer. The
+// count is reached through two functions found by argument dependent lookup:
+//    void intrusive_ptr_add_ref(T*);
+//    void intrusive_ptr_release(T*);
+// which intrusive_ref_counter and intrusive_weak_ref_counter supply to the
+// classes derived from them.
+template<class T>
+class intrusive_ptr
+{
+public:
+   using element_type = T;
+
+   constexpr intrusive_ptr() noexcept = default;
+
+   constexpr intrusive_ptr(std::nullptr_t) noexcept
+   {
+   }
+
+   // i_addRef is false to adopt a reference taken earlier, e.g. by detach().
+   intrusive_ptr(T* i_pointer, bool i_addRef = true) : m_pointer(i_pointer)
+   {
+      if (m_pointer && i_addRef) intrusive_ptr_add_ref(m_pointer);
+   }
+
+   intrusive_ptr(const intrusive_ptr& i_other) : intrusive_ptr(i_other.m_pointer)
+   {
+   }
+
+   template<class TOther, class = std::enable_if_t<std::is_convertible<TOther*, T*>::value>>
+   intrusive_ptr(const intrusive_ptr<TOther>& i_other) : intrusive_ptr(i_other.get())
+   {
+   }
+
+   intrusive_ptr(intrusive_ptr&& i_other) noexcept : m_pointer(i_other.m_pointer)
+   {
+      i_other.m_pointer = nullptr;
+   }
+
+   template<class TOther, class = std::enable_if_t<std::is_convertible<TOther*, T*>::value>>
+   intrusive_ptr(intrusive_ptr<TOther>&& i_other) noexcept : m_pointer(i_other.detach())
+   {
+   }
+
+   ~intrusive_ptr() noexcept
+   {
+      if (m_pointer) intrusive_ptr_release(m_pointer);
+   }
+
+   intrusive_ptr& operator=(const intrusive_ptr& i_other)
+   {
+      intrusive_ptr(i_other).swap(*this);
+      return *this;
+   }
+
+   template<class TOther>
+   intrusive_ptr& operator=(const intrusive_ptr<TOther>& i_other)
+   {
+      intrusive_ptr(i_other).swap(*this);
+      return *this;
+   }
+
+   intrusive_ptr& operator=(intrusive_ptr&& i_other) noexcept
+   {
+      intrusive_ptr(std::move(i_other)).swap(*this);
+      return *this;
+   }
+
+   template<class TOther>
+   intrusive_ptr& operator=(intrusive_ptr<TOther>&& i_other) noexcept
+   {
+      intrusive_ptr(std::move(i_other)).swap(*this);
+      return *this;
+   }
+
+   intrusive_ptr& operator=(T* i_pointer)
+   {
+      intrusive_ptr(i_pointer).swap(*this);
+      return *this;
+   }
+
+   void swap(intrusive_ptr& i_other) noexcept
+   {
+      std::swap(m_pointer, i_other.m_pointer);
+   }
+
+   void reset() noexcept
+   {
+      intrusive_ptr().swap(*this);
+   }
+
+   void reset(T* i_pointer, bool i_addRef = true)
+   {
+      intrusive_ptr(i_pointer, i_addRef).swap(*this);
+   }
+
+   // Gives up the pointer without releasing its reference.
+   T* detach() noexcept
+   {
+      T* pointer = m_pointer;
+      m_pointer = nullptr;
+      return pointer;
+   }
+
+   T* get() const noexcept
+   {
+      return m_pointer;
+   }
+
+   T& operator*() const
+   {
+      return *m_pointer;
+   }
+
+   T* operator->() const
+   {
+      return m_pointer;
+   }
+
+   explicit operator bool() const noexcept
+   {
+      return m_pointer != nullptr;
+   }
+
+private:
+   T* m_pointer = nullptr;
+};
+
+template<class T>
+struct is_trivially_relocatable<intrusive_ptr<T>> : std::true_type
+{
+};
+
+// Base class that counts the references of the class derived from it, which
+// is deleted with the last one. The count does not take part in copies: a
+// copy is a different object with owners of its own.
+template<class Derived, class RefCount = atomic_ref_count>
+class intrusive_ref_counter
+{
+public:
+   long use_count() const
+   {
+      return RefCount::load(m_refCount);
+   }
+
+protected:
+   intrusive_ref_counter() = default;
+
+   intrusive_ref_counter(const intrusive_ref_counter&)
+   {
+   }
+
+   intrusive_ref_counter& operator=(const intrusive_ref_counter&)
+   {
+      return *this;
+   }
+
+   ~intrusive_ref_counter() = default;
+
+private:
+   friend void intrusive_ptr_add_ref(const intrusive_ref_counter* i_object)
+   {
+      RefCount::increment(i_object->m_refCount);
+   }
+
+   friend void intrusive_ptr_release(const intrusive_ref_counter* i_object)
+   {
+      if (RefCount::decrement(i_object->m_refCount)) delete static_cast<const Derived*>(i_object);
+   }
+
+   mutable typename RefCount::count_type m_refCount = 0;
+};
+
+// intrusive_ref_counter for objects that weak_ptrs also refer to. The counts
+// live in a control block of the library that the object allocates when it
+// is constructed, so intrusive_ptr, shared_ptr and weak_ptr all share them:
+// the object is deleted with its last strong owner of either kind and the
+// block with its last weak_ptr. An intrusive_ptr stays the size of a raw
+// pointer; the object pays for a pointer to the block and the block itself.
+template<class Derived, class RefCount = atomic_ref_count>
+class intrusive_weak_ref_counter
+{
+public:
+   long use_count() const
+   {
+      return m_controlBlock->use_count();
+   }
+
+   // Empty unless an owner holds the object.
+   shared_ptr<Derived, RefCount> shared_from_this()
+   {
+      shared_ptr<Derived, RefCount> shared;
+      if (m_controlBlock->try_add_ref()) shared.set_pointers(static_cast<Derived*>(this), m_controlBlock);
+      return shared;
+   }
+
+   weak_ptr<Derived, RefCount> weak_from_this()
+   {
+      return shared_from_this();
+   }
+
+protected:
+   intrusive_weak_ref_counter() : m_controlBlock(new weak_block(this))
+   {
+   }
+
+   intrusive_weak_ref_counter(const intrusive_weak_ref_counter&) : intrusive_weak_ref_counter()
+   {
+   }
+
+   intrusive_weak_ref_counter& operator=(const intrusive_weak_ref_counter&)
+   {
+      return *this;
+   }
+
+   // Reached with a block only when no owner ever held the object, e.g. when
+   // it lived on the stack; the block then goes with its last weak_ptr.
+   ~intrusive_weak_ref_counter()
+   {
+      if (m_controlBlock) m_controlBlock->release_weak();
+   }
+
+private:
+   struct weak_block : public basic_control_block_base<RefCount>
+   {
+      using object_type = Derived;
+
+      explicit weak_block(intrusive_weak_ref_counter* i_object) : basic_control_block_base<RefCount>(this), m_object(i_object)
+      {
+      }
+
+      // The object no longer owns the block once its owners are gone.
+      void destroy()
+      {
+         m_object->m_controlBlock = nullptr;
+         delete static_cast<Derived*>(m_object);
+      }
+
+      static void deallocate(weak_block* i_block)
+      {
+         delete i_block;
+      }
+
+      intrusive_weak_ref_counter* m_object;
+   };
+
+   friend void intrusive_ptr_add_ref(const intrusive_weak_ref_counter* i_object)
+   {
+      i_object->m_controlBlock->add_ref();
+   }
+
+   friend void intrusive_ptr_release(const intrusive_weak_ref_counter* i_object)
+   {
+      i_object->m_controlBlock->release();
+   }
+
+   basic_control_block_base<RefCount>* m_controlBlock;
+};
+
+template<class TLeft, class TRight>
+bool operator==(const intrusive_ptr<TLeft>& i_lhs, const intrusive_ptr<TRight>& i_rhs)
+{
+   return i_lhs.get() == i_rhs.get();
+}
+
+template<class TLeft, class TRight>
+bool operator!=(const intrusive_ptr<TLeft>& i_lhs, const intrusive_ptr<TRight>& i_rhs)
+{
+   return i_lhs.get() != i_rhs.get();
+}
+
+template<class TLeft, class TRight>
+bool operator<(const intrusive_ptr<TLeft>& i_lhs, const intrusive_ptr<TRight>& i_rhs)
+{
+   return std::less<std::common_type_t<TLeft*, TRight*>>()(i_lhs.get(), i_rhs.get());
+}
+
+template<class TLeft>
+bool operator==(const intrusive_ptr<TLeft>& i_lhs, std::nullptr_t)
+{
+   return !i_lhs;
+}
+
+template<class TRight>
+bool operator==(std::nullptr_t, const intrusive_ptr<TRight>& i_rhs)
+{
+   return !i_rhs;
+}
+
+template<class TLeft>
+bool operator!=(const intrusive_ptr<TLeft>& i_lhs, std::nullptr_t)
+{
+   return static_cast<bool>(i_lhs);
+}
+
+template<class TRight>
+bool operator!=(std::nullptr_t, const intrusive_ptr<TRight>& i_rhs)
+{
+   return static_cast<bool>(i_rhs);
+}
+
+template<class TLeft>
+bool operator<(const intrusive_ptr<TLeft>& i_lhs, std::nullptr_t)
+{
+   return std::less<TLeft*>()(i_lhs.get(), nullptr);
+}
+
+template<class TRight>
+bool operator<(std::nullptr_t, const intrusive_ptr<TRight>& i_rhs)
+{
+   return std::less<TRight*>()(nullptr, i_rhs.get());
+}
+
+template<class TLeft>
+bool operator>(const intrusive_ptr<TLeft>& i_lhs, std::nullptr_t)
+{
+   return nullptr < i_lhs;
+}
+
+template<class TRight>
+bool operator>(std::nullptr_t, const intrusive_ptr<TRight>& i_rhs)
+{
+   return i_rhs < nullptr;
+}
+
+template<class TLeft>
+bool operator<=(const intrusive_ptr<TLeft>& i_lhs, std::nullptr_t)
+{
+   return !(nullptr < i_lhs);
+}
+
+template<class TRight>
+bool operator<=(std::nullptr_t, const intrusive_ptr<TRight>& i_rhs)
+{
+   return !(i_rhs < nullptr);
+}
+
+template<class TLeft>
+bool operator>=(const intrusive_ptr<TLeft>& i_lhs, std::nullptr_t)
+{
+   return !(i_lhs < nullptr);
+}
+
+template<class TRight>
+bool operator>=(std::nullptr_t, const intrusive_ptr<TRight>& i_rhs)
+{
+   return !(nullptr < i_rhs);
+}
+
+template<class T>
+void swap(intrusive_ptr<T>& i_lhs, intrusive_ptr<T>& i_rhs) noexcept
+{
+   i_lhs.swap(i_rhs);
+}
+
+template<class T, class TOther>
+intrusive_ptr<T> static_pointer_cast(const intrusive_ptr<TOther>& i_ptr)
+{
+   return intrusive_ptr<T>(static_cast<T*>(i_ptr.get()));
+}
+
+template<class T, class TOther>
+intrusive_ptr<T> dynamic_pointer_cast(const intrusive_ptr<TOther>& i_ptr)
+{
+   return intrusive_ptr<T>(dynamic_cast<T*>(i_ptr.get()));
+}
+
+template<class T, class TOther>
+intrusive_ptr<T> const_pointer_cast(const intrusive_ptr<TOther>& i_ptr)
+{
+   return intrusive_ptr<T>(const_cast<T*>(i_ptr.get()));
+}
+
+template<class T, class TOther>
+intrusive_ptr<T> static_pointer_cast(intrusive_ptr<TOther>&& i_ptr)
+{
+   return intrusive_ptr<T>(static_cast<T*>(i_ptr.detach()), false);
+}
+
+// i_ptr keeps its reference if the cast fails.
+template<class T, class TOther>
+intrusive_ptr<T> dynamic_pointer_cast(intrusive_ptr<TOther>&& i_ptr)
+{
+   T* pointer = dynamic_cast<T*>(i_ptr.get());
+   if (pointer) i_ptr.detach();
+   return intrusive_ptr<T>(pointer, false);
+}
+
+template<class T, class TOther>
+intrusive_ptr<T> const_pointer_cast(intrusive_ptr<TOther>&& i_ptr)
+{
+   return intrusive_ptr<T>(const_cast<T*>(i_ptr.detach()), false);
+}
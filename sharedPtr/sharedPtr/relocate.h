@@ -0,0 +1,425 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <new>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "sharedPtr.h"
+
+// Moves the object at i_source to the raw memory at i_destination and ends
+// the lifetime of the source, with one memcpy for trivially relocatable types
+// and a move and a destruction for the others.
+template<class T>
+void relocate_at(T* i_source, T* i_destination) noexcept
+{
+   if constexpr (is_trivially_relocatable<T>::value)
+   {
+      std::memcpy(static_cast<void*>(i_destination), static_cast<const void*>(i_source), sizeof(T));
+   }
+   else
+   {
+      ::new (static_cast<void*>(i_destination)) T(std::move(*i_source));
+      i_source->~T();
+   }
+}
+
+// Relocates [i_first, i_last) to the raw memory at i_destination, which must
+// not overlap it, and returns the end of the relocated range.
+template<class T>
+T* uninitialized_relocate(T* i_first, T* i_last, T* i_destination) noexcept
+{
+   if constexpr (is_trivially_relocatable<T>::value)
+   {
+      if (i_first != i_last) std::memcpy(static_cast<void*>(i_destination), static_cast<const void*>(i_first), (i_last - i_first) * sizeof(T));
+      return i_destination + (i_last - i_first);
+   }
+   else
+   {
+      for (; i_first != i_last; ++i_first, ++i_destination) relocate_at(i_first, i_destination);
+      return i_destination;
+   }
+}
+
+// Relocates [i_first, i_last) to i_destination within the same buffer, in
+// either direction; the elements it moves over must have been relocated away.
+template<class T>
+void relocate_within(T* i_first, T* i_last, T* i_destination) noexcept
+{
+   if constexpr (is_trivially_relocatable<T>::value)
+   {
+      if (i_first != i_last) std::memmove(static_cast<void*>(i_destination), static_cast<const void*>(i_first), (i_last - i_first) * sizeof(T));
+   }
+   else if (i_destination < i_first)
+   {
+      uninitialized_relocate(i_first, i_last, i_destination);
+   }
+   else
+   {
+      for (T* destination = i_destination + (i_last - i_first); i_last != i_first;) relocate_at(--i_last, --destination);
+   }
+}
+
+// Vector that keeps up to N elements in place before it allocates, and
+// relocates its elements when it grows or shifts them: a vector of
+// shared_ptrs grows with memcpy, without touching a reference count.
+// Elements that are not trivially relocatable must move without throwing.
+template<class T, std::size_t N>
+class small_vector
+{
+   static_assert(is_trivially_relocatable<T>::value || std::is_nothrow_move_constructible<T>::value, "small_vector relocates its elements, which must not throw");
+
+public:
+   using value_type = T;
+   using size_type = std::size_t;
+   using iterator = T*;
+   using const_iterator = const T*;
+
+   small_vector() noexcept = default;
+
+   // The destructor does not run if a copy throws, so the elements copied
+   // so far are destroyed here.
+   small_vector(const small_vector& i_other)
+   {
+      reserve(i_other.size());
+      try
+      {
+         for (const T& value : i_other) push_back(value);
+      }
+      catch (...)
+      {
+         clear();
+         release_storage();
+         throw;
+      }
+   }
+
+   small_vector(small_vector&& i_other) noexcept
+   {
+      take_over(i_other);
+   }
+
+   ~small_vector()
+   {
+      clear();
+      release_storage();
+   }
+
+   small_vector& operator=(const small_vector& i_other)
+   {
+      if (this != &i_other) small_vector(i_other).swap(*this);
+      return *this;
+   }
+
+   small_vector& operator=(small_vector&& i_other) noexcept
+   {
+      if (this != &i_other)
+      {
+         clear();
+         release_storage();
+         take_over(i_other);
+      }
+      return *this;
+   }
+
+   void swap(small_vector& i_other) noexcept
+   {
+      small_vector other(std::move(i_other));
+      i_other = std::move(*this);
+      *this = std::move(other);
+   }
+
+   size_type size() const noexcept
+   {
+      return m_size;
+   }
+
+   size_type capacity() const noexcept
+   {
+      return m_capacity;
+   }
+
+   bool empty() const noexcept
+   {
+      return m_size == 0;
+   }
+
+   T* data() noexcept
+   {
+      return m_data;
+   }
+
+   const T* data() const noexcept
+   {
+      return m_data;
+   }
+
+   iterator begin() noexcept
+   {
+      return m_data;
+   }
+
+   iterator end() noexcept
+   {
+      return m_data + m_size;
+   }
+
+   const_iterator begin() const noexcept
+   {
+      return m_data;
+   }
+
+   const_iterator end() const noexcept
+   {
+      return m_data + m_size;
+   }
+
+   T& operator[](size_type i_index) noexcept
+   {
+      return m_data[i_index];
+   }
+
+   const T& operator[](size_type i_index) const noexcept
+   {
+      return m_data[i_index];
+   }
+
+   T& back() noexcept
+   {
+      return m_data[m_size - 1];
+   }
+
+   void reserve(size_type i_capacity)
+   {
+      if (i_capacity <= m_capacity) return;
+
+      T* data = static_cast<T*>(::operator new(i_capacity * sizeof(T), std::align_val_t(alignof(T))));
+      uninitialized_relocate(m_data, m_data + m_size, data);
+      release_storage();
+      m_data = data;
+      m_capacity = i_capacity;
+   }
+
+   template<class... ParamTypes>
+   T& emplace_back(ParamTypes&&... i_params)
+   {
+      if (m_size == m_capacity) return *emplace(end(), std::forward<ParamTypes>(i_params)...);
+
+      T* element = ::new (static_cast<void*>(m_data + m_size)) T(std::forward<ParamTypes>(i_params)...);
+      ++m_size;
+      return *element;
+   }
+
+   void push_back(const T& i_value)
+   {
+      emplace_back(i_value);
+   }
+
+   void push_back(T&& i_value)
+   {
+      emplace_back(std::move(i_value));
+   }
+
+   // The new element is built before room is made for it, so i_params may
+   // refer to elements of the vector.
+   template<class... ParamTypes>
+   iterator emplace(const_iterator i_position, ParamTypes&&... i_params)
+   {
+      size_type index = i_position - m_data;
+      T value(std::forward<ParamTypes>(i_params)...);
+      if (m_size == m_capacity) reserve(std::max<size_type>(2 * m_capacity, 1));
+
+      T* position = m_data + index;
+      relocate_within(position, m_data + m_size, position + 1);
+      ::new (static_cast<void*>(position)) T(std::move(value));
+      ++m_size;
+      return position;
+   }
+
+   iterator insert(const_iterator i_position, T&& i_value)
+   {
+      return emplace(i_position, std::move(i_value));
+   }
+
+   iterator insert(const_iterator i_position, const T& i_value)
+   {
+      return emplace(i_position, i_value);
+   }
+
+   iterator erase(const_iterator i_position) noexcept
+   {
+      T* position = m_data + (i_position - m_data);
+      position->~T();
+      relocate_within(position + 1, m_data + m_size, position);
+      --m_size;
+      return position;
+   }
+
+   void pop_back() noexcept
+   {
+      m_data[--m_size].~T();
+   }
+
+   void clear() noexcept
+   {
+      for (size_type i = 0; i < m_size; i++) m_data[i].~T();
+      m_size = 0;
+   }
+
+private:
+   T* inline_data() noexcept
+   {
+      return reinterpret_cast<T*>(m_inline);
+   }
+
+   bool is_inline() const noexcept
+   {
+      return m_data == reinterpret_cast<const T*>(m_inline);
+   }
+
+   void release_storage() noexcept
+   {
+      if (!is_inline()) ::operator delete(m_data, std::align_val_t(alignof(T)));
+      m_data = inline_data();
+      m_capacity = N;
+   }
+
+   // Expects the storage to be released; leaves i_other empty and inline.
+   void take_over(small_vector& i_other) noexcept
+   {
+      if (i_other.is_inline())
+      {
+         uninitialized_relocate(i_other.m_data, i_other.m_data + i_other.m_size, m_data);
+      }
+      else
+      {
+         m_data = i_other.m_data;
+         m_capacity = i_other.m_capacity;
+         i_other.m_data = i_other.inline_data();
+         i_other.m_capacity = N;
+      }
+      m_size = i_other.m_size;
+      i_other.m_size = 0;
+   }
+
+   alignas(T) unsigned char m_inline[(N > 0 ? N : 1) * sizeof(T)];
+   T* m_data = inline_data();
+   size_type m_size = 0;
+   size_type m_capacity = N;
+};
+
+// Map kept as a sorted small_vector of pairs: lookups are binary searches
+// over contiguous memory, and inserting or erasing relocates the entries
+// behind the position, with one memmove when keys and values are trivially
+// relocatable, as shared_ptrs are.
+template<class Key, class Value, class Compare = std::less<Key>, std::size_t N = 0>
+class flat_map
+{
+public:
+   using value_type = std::pair<Key, Value>;
+   using iterator = typename small_vector<value_type, N>::iterator;
+   using const_iterator = typename small_vector<value_type, N>::const_iterator;
+
+   std::size_t size() const noexcept
+   {
+      return m_entries.size();
+   }
+
+   bool empty() const noexcept
+   {
+      return m_entries.empty();
+   }
+
+   iterator begin() noexcept
+   {
+      return m_entries.begin();
+   }
+
+   iterator end() noexcept
+   {
+      return m_entries.end();
+   }
+
+   const_iterator begin() const noexcept
+   {
+      return m_entries.begin();
+   }
+
+   const_iterator end() const noexcept
+   {
+      return m_entries.end();
+   }
+
+   void reserve(std::size_t i_capacity)
+   {
+      m_entries.reserve(i_capacity);
+   }
+
+   iterator lower_bound(const Key& i_key)
+   {
+      return std::lower_bound(m_entries.begin(), m_entries.end(), i_key, [this](const value_type& i_entry, const Key& i_searched) { return m_compare(i_entry.first, i_searched); });
+   }
+
+   iterator find(const Key& i_key)
+   {
+      iterator found = lower_bound(i_key);
+      return found != end() && !m_compare(i_key, found->first) ? found : end();
+   }
+
+   std::size_t count(const Key& i_key)
+   {
+      return find(i_key) != end() ? 1 : 0;
+   }
+
+   // Returns the entry of the key and whether it was inserted; an existing
+   // entry keeps its value.
+   template<class... ParamTypes>
+   std::pair<iterator, bool> try_emplace(const Key& i_key, ParamTypes&&... i_params)
+   {
+      iterator found = lower_bound(i_key);
+      if (found != end() && !m_compare(i_key, found->first)) return { found, false };
+
+      return { m_entries.emplace(found, std::piecewise_construct, std::forward_as_tuple(i_key), std::forward_as_tuple(std::forward<ParamTypes>(i_params)...)), true };
+   }
+
+   std::pair<iterator, bool> insert(value_type i_entry)
+   {
+      iterator found = lower_bound(i_entry.first);
+      if (found != end() && !m_compare(i_entry.first, found->first)) return { found, false };
+
+      return { m_entries.insert(found, std::move(i_entry)), true };
+   }
+
+   Value& operator[](const Key& i_key)
+   {
+      return try_emplace(i_key).first->second;
+   }
+
+   iterator erase(const_iterator i_position) noexcept
+   {
+      return m_entries.erase(i_position);
+   }
+
+   std::size_t erase(const Key& i_key)
+   {
+      iterator found = find(i_key);
+      if (found == end()) return 0;
+
+      m_entries.erase(found);
+      return 1;
+   }
+
+   void clear() noexcept
+   {
+      m_entries.clear();
+   }
+
+private:
+   small_vector<value_type, N> m_entries;
+   Compare m_compare;
+};
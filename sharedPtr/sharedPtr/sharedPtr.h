@@ -1,223 +1,1173 @@
-#pragma once;
+#pragma once
 
 #include <type_traits>
 #include <atomic>
-
-template<class T>
-class weak_ptr;
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <new>
+#include <typeinfo>
+#include <utility>
+
+#include "controlBlockPool.h"
+
+// Set to 1 to allocate the control blocks of every type from
+// control_block_pool. It must have the same value in every translation unit
+// of a program; to pool a single type specialize use_control_block_pool.
+#ifndef SHARED_PTR_CONTROL_BLOCK_POOL
+#define SHARED_PTR_CONTROL_BLOCK_POOL 0
+#endif
+
+// Set to 1 to use 32-bit reference counts, which saves 8 bytes per control
+// block on 64-bit targets and limits an object to 2^31 - 1 owners. The same
+// value is required in every translation unit of a program.
+#ifndef SHARED_PTR_32BIT_COUNTERS
+#define SHARED_PTR_32BIT_COUNTERS 0
+#endif
+
+// Size of the cache lines make_shared_padded keeps the object and the
+// reference counts apart by.
+#ifndef SHARED_PTR_CACHE_LINE_SIZE
+#define SHARED_PTR_CACHE_LINE_SIZE 64
+#endif
+
+// Set to 1 to count the live objects, control blocks and bytes of every
+// type in type_accounting. The same value is required in every translation
+// unit of a program; with 0 the control blocks count nothing.
+#ifndef SHARED_PTR_ACCOUNTING
+#define SHARED_PTR_ACCOUNTING 0
+#endif
+
+#if SHARED_PTR_ACCOUNTING
+#include "typeAccounting.h"
+#endif
+
+// Set to 1 to time a sample of the reference count operations in
+// contention_profiler. With 0 the counts are updated as they are.
+#ifndef SHARED_PTR_CONTENTION_PROFILER
+#define SHARED_PTR_CONTENTION_PROFILER 0
+#endif
+
+#if SHARED_PTR_CONTENTION_PROFILER
+#include "contentionProfiler.h"
+#endif
+
+using ref_count_value = std::conditional_t<SHARED_PTR_32BIT_COUNTERS != 0, std::int32_t, long>;
 
 class bad_weak_ptr : public std::exception
 {
 public:
-   bad_weak_ptr() : std::exception("bad_weak_ptr")
+   virtual const char* what() const noexcept override
+   {
+      return "bad_weak_ptr";
+   }
+};
+
+// Reference count policy for pointers shared between threads.
+struct atomic_ref_count
+{
+   using count_type = std::atomic<ref_count_value>;
+   using weak_ref_count = atomic_ref_count;
+
+   // Taking a reference only needs atomicity: the new owner already holds a
+   // reference, so the block cannot go away concurrently.
+   static void increment(count_type& i_count)
+   {
+      i_count.fetch_add(1, std::memory_order_relaxed);
+   }
+
+   // Increments unless the count is zero. The count never leaves zero once it
+   // got there, so a weak_ptr cannot resurrect an object whose destroy() is
+   // running.
+   static bool increment_if_not_zero(count_type& i_count)
+   {
+      ref_count_value count = i_count.load(std::memory_order_relaxed);
+      do
+      {
+         if (count == 0) return false;
+      } while (!i_count.compare_exchange_weak(count, count + 1, std::memory_order_acq_rel, std::memory_order_relaxed));
+      return true;
+   }
+
+   // Returns true for the decrement that dropped the count to zero. Every
+   // decrement publishes the owner's writes; the last one acquires them all
+   // before the caller destroys anything.
+   static bool decrement(count_type& i_count)
+   {
+      if (i_count.fetch_sub(1, std::memory_order_release) != 1) return false;
+      std::atomic_thread_fence(std::memory_order_acquire);
+      return true;
+   }
+
+   static long load(const count_type& i_count)
+   {
+      return i_count.load(std::memory_order_relaxed);
+   }
+
+   static long load_acquire(const count_type& i_count)
+   {
+      return i_count.load(std::memory_order_acquire);
+   }
+};
+
+// Reference count policy for pointers confined to one thread.
+struct local_ref_count
+{
+   using count_type = ref_count_value;
+   using weak_ref_count = local_ref_count;
+
+   static void increment(count_type& i_count)
+   {
+      ++i_count;
+   }
+
+   static bool increment_if_not_zero(count_type& i_count)
+   {
+      if (i_count == 0) return false;
+      ++i_count;
+      return true;
+   }
+
+   static bool decrement(count_type& i_count)
+   {
+      return --i_count == 0;
+   }
+
+   static long load(const count_type& i_count)
+   {
+      return i_count;
+   }
+
+   static long load_acquire(const count_type& i_count)
+   {
+      return i_count;
+   }
+};
+
+// Reference count policy for the few objects that every thread copies. The
+// strong count is spread over shards of a cache line each, and every thread
+// counts on the shard it is assigned to, so threads on different shards do
+// not contend. References are interchangeable, a thread releases one from
+// its own shard if it can and from any other one otherwise.
+//
+// m_central holds the references counted on no shard in its low half and a
+// token for every shard with a count above zero in its high half; a shard
+// takes its token before its count leaves zero and gives it back after its
+// count returned to zero. m_central is zero exactly when no reference is
+// left, which is the only zero check the count needs. Weak references are
+// counted as with atomic_ref_count.
+struct sharded_ref_count
+{
+   static const std::size_t s_shardCount = 16;
+
+   struct alignas(SHARED_PTR_CACHE_LINE_SIZE) shard
+   {
+      std::atomic<ref_count_value> m_count{ 0 };
+   };
+
+   struct count_type
+   {
+      count_type(std::uint32_t i_references)
+      {
+         m_central.store(i_references, std::memory_order_relaxed);
+      }
+
+      alignas(SHARED_PTR_CACHE_LINE_SIZE) std::atomic<std::uint64_t> m_central;
+      shard m_shards[s_shardCount];
+   };
+
+   using weak_ref_count = atomic_ref_count;
+
+   static const std::uint64_t s_token = std::uint64_t(1) << 32;
+   static const std::uint64_t s_referenceMask = s_token - 1;
+
+   static void increment(count_type& i_count)
+   {
+      add(i_count, false);
+   }
+
+   static bool increment_if_not_zero(count_type& i_count)
+   {
+      return add(i_count, true);
+   }
+
+   static bool decrement(count_type& i_count)
+   {
+      std::size_t first = local_shard();
+      for (;;)
+      {
+         for (std::size_t i = 0; i < s_shardCount; i++)
+         {
+            auto& shardCount = i_count.m_shards[(first + i) % s_shardCount].m_count;
+            ref_count_value count = shardCount.load(std::memory_order_relaxed);
+            while (count > 0)
+            {
+               if (!shardCount.compare_exchange_weak(count, count - 1, std::memory_order_acq_rel, std::memory_order_relaxed)) continue;
+               return count == 1 && release_token(i_count);
+            }
+         }
+
+         // No shard had a reference left, take one counted centrally. Its
+         // absence means a shard received a reference behind the scan.
+         std::uint64_t central = i_count.m_central.load(std::memory_order_relaxed);
+         while (central & s_referenceMask)
+         {
+            if (i_count.m_central.compare_exchange_weak(central, central - 1, std::memory_order_release, std::memory_order_relaxed))
+            {
+               if (central != 1) return false;
+               std::atomic_thread_fence(std::memory_order_acquire);
+               return true;
+            }
+         }
+      }
+   }
+
+   static long load(const count_type& i_count)
+   {
+      long count = static_cast<long>(i_count.m_central.load(std::memory_order_relaxed) & s_referenceMask);
+      for (const auto& countShard : i_count.m_shards) count += countShard.m_count.load(std::memory_order_relaxed);
+      return count;
+   }
+
+private:
+   static std::size_t local_shard()
+   {
+      static std::atomic<std::size_t> s_nextShard{ 0 };
+      thread_local std::size_t t_shard = s_nextShard.fetch_add(1, std::memory_order_relaxed) % s_shardCount;
+      return t_shard;
+   }
+
+   // Adds a reference to the caller's shard, taking the shard's token first
+   // when its count is zero. With i_ifNotZero the token is only taken while
+   // any reference is left, so an expired object stays expired.
+   static bool add(count_type& i_count, bool i_ifNotZero)
+   {
+      auto& shardCount = i_count.m_shards[local_shard()].m_count;
+      ref_count_value count = shardCount.load(std::memory_order_relaxed);
+      for (;;)
+      {
+         if (count > 0)
+         {
+            if (shardCount.compare_exchange_weak(count, count + 1, std::memory_order_relaxed)) return true;
+            continue;
+         }
+
+         if (!take_token(i_count, i_ifNotZero)) return false;
+         if (shardCount.compare_exchange_strong(count, 1, std::memory_order_relaxed)) return true;
+
+         // Another thread of the shard took the token first. The caller
+         // holds a reference or got past the zero check, so this cannot be
+         // the last token.
+         i_count.m_central.fetch_sub(s_token, std::memory_order_relaxed);
+      }
+   }
+
+   static bool take_token(count_type& i_count, bool i_ifNotZero)
+   {
+      if (!i_ifNotZero)
+      {
+         i_count.m_central.fetch_add(s_token, std::memory_order_relaxed);
+         return true;
+      }
+
+      std::uint64_t central = i_count.m_central.load(std::memory_order_relaxed);
+      do
+      {
+         if (central == 0) return false;
+      } while (!i_count.m_central.compare_exchange_weak(central, central + s_token, std::memory_order_acq_rel, std::memory_order_relaxed));
+      return true;
+   }
+
+   // Returns true if the token was the last thing m_central counted.
+   static bool release_token(count_type& i_count)
+   {
+      if (i_count.m_central.fetch_sub(s_token, std::memory_order_release) != s_token) return false;
+      std::atomic_thread_fence(std::memory_order_acquire);
+      return true;
+   }
+};
+
+template<class Block, class RefCount>
+struct control_block_operations;
+
+// Control blocks are type erased through a static table of operations per
+// block type instead of a vtable: releasing the last reference costs one
+// indirect call, and the block has no virtual destructor to run.
+template<class RefCount>
+struct basic_control_block_base
+{
+   using weak_ref_count = typename RefCount::weak_ref_count;
+
+   struct operations
+   {
+      void (*m_destroy)(basic_control_block_base*);
+      void (*m_deallocate)(basic_control_block_base*);
+      void (*m_destroyAndDeallocate)(basic_control_block_base*);
+      void* (*m_getDeleter)(basic_control_block_base*, const std::type_info&);
+#if SHARED_PTR_ACCOUNTING
+      std::size_t (*m_accountingSlot)();
+      std::size_t m_blockBytes;
+      std::size_t m_objectBytes;
+#endif
+   };
+
+   template<class Block>
+   explicit basic_control_block_base(Block*) : m_operations(&control_block_operations<Block, RefCount>::s_operations)
+   {
+#if SHARED_PTR_ACCOUNTING
+      account_block(1);
+#endif
+   }
+
+   basic_control_block_base(const basic_control_block_base&) = delete;
+   basic_control_block_base& operator=(const basic_control_block_base&) = delete;
+
+#if SHARED_PTR_ACCOUNTING
+   ~basic_control_block_base()
+   {
+      account_block(-1);
+   }
+
+   // Counts the block in or out under the type of its object. The bytes of
+   // an object owned through a plain pointer are counted out by destroy().
+   void account_block(long long i_sign)
+   {
+      std::size_t slot = m_operations->m_accountingSlot();
+      type_accounting::add(slot, type_accounting::live_blocks, i_sign);
+      type_accounting::add(slot, type_accounting::bytes, i_sign * static_cast<long long>(m_operations->m_blockBytes + (i_sign > 0 ? m_operations->m_objectBytes : 0)));
+   }
+
+   void account(type_accounting::counter i_counter, long long i_delta)
+   {
+      type_accounting::add(m_operations->m_accountingSlot(), i_counter, i_delta);
+   }
+#endif
+
+   // A block derived from another block type calls this from its
+   // constructor, the way a vptr is updated during construction.
+   template<class Block>
+   void use_operations_of(Block*)
+   {
+#if SHARED_PTR_ACCOUNTING
+      account_block(-1);
+      account(type_accounting::bytes, -static_cast<long long>(m_operations->m_objectBytes));
+#endif
+      m_operations = &control_block_operations<Block, RefCount>::s_operations;
+#if SHARED_PTR_ACCOUNTING
+      account_block(1);
+#endif
+   }
+
+   // Destroys the owned object, the block stays alive for weak references.
+   void destroy()
+   {
+      m_operations->m_destroy(this);
+   }
+
+   // Frees the block itself, the owned object is already destroyed. Whether
+   // it is follows from the counts, the block does not track it.
+   void deallocate()
+   {
+      m_operations->m_deallocate(this);
+   }
+
+   void destroy_and_deallocate()
+   {
+      m_operations->m_destroyAndDeallocate(this);
+   }
+
+   void* get_deleter(const std::type_info& i_type)
+   {
+      return m_operations->m_getDeleter(this, i_type);
+   }
+
+   // Defaults for the block types, which override them by name.
+   static void* get_deleter(basic_control_block_base*, const std::type_info&)
+   {
+      return nullptr;
+   }
+
+   // True for blocks whose destroy() has nothing to run: their table skips
+   // it, and the last release frees the block with a single call.
+   static constexpr bool s_destroysNothing = false;
+
+   // Type the block is accounted under, and the size of the object when it
+   // is allocated apart from the block.
+   using object_type = void;
+   static constexpr std::size_t s_objectBytes = 0;
+
+   // With SHARED_PTR_CONTENTION_PROFILER the count operations below are
+   // sampled, and attributed to the block and to the function they were
+   // inlined into.
+   void add_ref()
+   {
+#if SHARED_PTR_CONTENTION_PROFILER
+      if (contention_profiler::should_sample()) return contention_profiler::timed(this, SHARED_PTR_RETURN_ADDRESS(), [this] { RefCount::increment(m_refCount); });
+#endif
+      RefCount::increment(m_refCount);
+   }
+
+   void add_weak_ref()
+   {
+#if SHARED_PTR_CONTENTION_PROFILER
+      if (contention_profiler::should_sample()) return contention_profiler::timed(this, SHARED_PTR_RETURN_ADDRESS(), [this] { weak_ref_count::increment(m_weakRefCount); });
+#endif
+      weak_ref_count::increment(m_weakRefCount);
+   }
+
+   bool try_add_ref()
+   {
+#if SHARED_PTR_CONTENTION_PROFILER
+      if (contention_profiler::should_sample()) return contention_profiler::timed(this, SHARED_PTR_RETURN_ADDRESS(), [this] { return RefCount::increment_if_not_zero(m_refCount); });
+#endif
+      return RefCount::increment_if_not_zero(m_refCount);
+   }
+
+   bool release_ref()
+   {
+#if SHARED_PTR_CONTENTION_PROFILER
+      if (contention_profiler::should_sample()) return contention_profiler::timed(this, SHARED_PTR_RETURN_ADDRESS(), [this] { return RefCount::decrement(m_refCount); });
+#endif
+      return RefCount::decrement(m_refCount);
+   }
+
+   bool release_weak_ref()
+   {
+#if SHARED_PTR_CONTENTION_PROFILER
+      if (contention_profiler::should_sample()) return contention_profiler::timed(this, SHARED_PTR_RETURN_ADDRESS(), [this] { return weak_ref_count::decrement(m_weakRefCount); });
+#endif
+      return weak_ref_count::decrement(m_weakRefCount);
+   }
+
+   // Drops a strong reference. All strong owners together hold one weak
+   // reference, so the block is freed by whichever release takes the weak
+   // count to zero. If nobody else can reach the block any more the object
+   // and the block go away together without a second decrement.
+   void release()
+   {
+      if (!release_ref()) return;
+
+      if (weak_ref_count::load_acquire(m_weakRefCount) == 1)
+      {
+         destroy_and_deallocate();
+         return;
+      }
+
+      destroy();
+      release_weak();
+   }
+
+   void release_weak()
+   {
+      if (release_weak_ref()) deallocate();
+   }
+
+   long use_count() const
+   {
+      return RefCount::load(m_refCount);
+   }
+
+   const operations* m_operations;
+   typename weak_ref_count::count_type m_weakRefCount = 1;
+   typename RefCount::count_type m_refCount = 0;
+};
+
+template<class Block, class RefCount>
+struct control_block_operations
+{
+   using base_type = basic_control_block_base<RefCount>;
+
+   static void destroy(base_type* i_block)
+   {
+      static_cast<Block*>(i_block)->destroy();
+      account_destroyed(i_block);
+   }
+
+   // Frees the block after destroy(), once the weak references are gone.
+   static void deallocate(base_type* i_block)
+   {
+#if SHARED_PTR_ACCOUNTING
+      i_block->account(type_accounting::zombie_blocks, -1);
+#endif
+      forget_sampled(i_block);
+      Block::deallocate(static_cast<Block*>(i_block));
+   }
+
+   static void destroy_and_deallocate(base_type* i_block)
+   {
+      Block* block = static_cast<Block*>(i_block);
+      block->destroy();
+      free_object_and_block(block);
+   }
+
+   static void destroy_nothing(base_type* i_block)
+   {
+      account_destroyed(i_block);
+   }
+
+   static void free_object_and_block(base_type* i_block)
+   {
+#if SHARED_PTR_ACCOUNTING
+      i_block->account(type_accounting::bytes, -static_cast<long long>(Block::s_objectBytes));
+#endif
+      forget_sampled(i_block);
+      Block::deallocate(static_cast<Block*>(i_block));
+   }
+
+   // Gives the profiler slot of a freed block back.
+   static void forget_sampled(base_type* i_block)
+   {
+#if SHARED_PTR_CONTENTION_PROFILER
+      contention_profiler::forget(i_block);
+#else
+      (void)i_block;
+#endif
+   }
+
+   static void account_destroyed(base_type* i_block)
+   {
+#if SHARED_PTR_ACCOUNTING
+      i_block->account(type_accounting::zombie_blocks, 1);
+      i_block->account(type_accounting::bytes, -static_cast<long long>(Block::s_objectBytes));
+#else
+      (void)i_block;
+#endif
+   }
+
+   static void* get_deleter(base_type* i_block, const std::type_info& i_type)
+   {
+      return Block::get_deleter(static_cast<Block*>(i_block), i_type);
+   }
+
+   static constexpr typename base_type::operations s_operations =
+   {
+      Block::s_destroysNothing ? &destroy_nothing : &destroy,
+      &deallocate,
+      Block::s_destroysNothing ? &free_object_and_block : &destroy_and_deallocate,
+      &get_deleter,
+#if SHARED_PTR_ACCOUNTING
+      &type_accounting::slot_of<typename Block::object_type>,
+      sizeof(Block),
+      Block::s_objectBytes
+#endif
+   };
+};
+
+using control_block_base = basic_control_block_base<atomic_ref_count>;
+
+template<class T, class RefCount = atomic_ref_count>
+class weak_ptr;
+
+template<class T, class RefCount = atomic_ref_count>
+class shared_ptr;
+
+template<class T, class RefCount = atomic_ref_count>
+class enable_shared_from_this;
+
+template<class Derived, class RefCount>
+class intrusive_weak_ref_counter;
+
+// Points the weak_ptr embedded in an object deriving from
+// enable_shared_from_this at the shared_ptr that just took ownership of it.
+template<class TBase, class RefCount, class T>
+void enable_weak_this(const enable_shared_from_this<TBase, RefCount>* i_base, const shared_ptr<T, RefCount>* i_owner);
+
+// Any other object has nothing to wire up.
+inline void enable_weak_this(const volatile void*, const void*)
+{
+}
+
+// An object whose enable_shared_from_this counts references with another
+// policy than its owner could never hand out a shared_ptr to itself.
+template<class TBase, class BaseRefCount, class T, class RefCount>
+void enable_weak_this(const enable_shared_from_this<TBase, BaseRefCount>*, const shared_ptr<T, RefCount>*)
+{
+   static_assert(std::is_same<BaseRefCount, RefCount>::value, "the owner of an enable_shared_from_this object must use the same reference count policy");
+}
+
+// Types whose objects may be moved to another address by copying their bytes,
+// the source then being left as raw memory without running its destructor.
+// Holds for trivially copyable types and for the pointers of the library,
+// which are two pointers with nothing that points into the pointer itself;
+// specialize it for other such types.
+template<class T>
+struct is_trivially_relocatable : std::is_trivially_copyable<T>
+{
+};
+
+template<class T, class RefCount>
+struct is_trivially_relocatable<shared_ptr<T, RefCount>> : std::true_type
+{
+};
+
+template<class T, class RefCount>
+struct is_trivially_relocatable<weak_ptr<T, RefCount>> : std::true_type
+{
+};
+
+template<class First, class Second>
+struct is_trivially_relocatable<std::pair<First, Second>> : std::integral_constant<bool, is_trivially_relocatable<First>::value && is_trivially_relocatable<Second>::value>
+{
+};
+
+template<class T>
+struct use_control_block_pool : std::integral_constant<bool, SHARED_PTR_CONTROL_BLOCK_POOL != 0>
+{
+};
+
+// Allocation functions of the control blocks created with new for pointers
+// to T: from control_block_pool when it is enabled for T, from the global
+// heap otherwise.
+template<class T>
+struct control_block_allocation
+{
+   static void* operator new(std::size_t i_size)
+   {
+      return use_control_block_pool<T>::value ? control_block_pool::allocate(i_size) : ::operator new(i_size);
+   }
+
+   static void operator delete(void* i_pointer, std::size_t i_size)
+   {
+      if (use_control_block_pool<T>::value) control_block_pool::deallocate(i_pointer, i_size);
+      else ::operator delete(i_pointer);
+   }
+
+   static void* operator new(std::size_t i_size, std::align_val_t i_alignment)
+   {
+      return ::operator new(i_size, i_alignment);
+   }
+
+   static void operator delete(void* i_pointer, std::size_t, std::align_val_t i_alignment)
+   {
+      ::operator delete(i_pointer, i_alignment);
+   }
+};
+
+// Holds a value of type T; empty types are stored as a base class so that
+// they add nothing to the size of the holder.
+template<class T, bool = std::is_empty<T>::value && !std::is_final<T>::value>
+struct ebo_storage : private T
+{
+   ebo_storage(const T& i_value) : T(i_value)
+   {
+   }
+
+   T& value()
+   {
+      return *this;
+   }
+};
+
+template<class T>
+struct ebo_storage<T, false>
+{
+   ebo_storage(const T& i_value) : m_value(i_value)
+   {
+   }
+
+   T& value()
+   {
+      return m_value;
+   }
+
+   T m_value;
+};
+
+// Size of the objects a block owns through a plain pointer; 0 where it
+// cannot tell. A deleter block counts the one object it points to.
+template<class T, class = void>
+struct object_size : std::integral_constant<std::size_t, 0>
+{
+};
+
+template<class T>
+struct object_size<T, std::enable_if_t<!std::is_void<T>::value && !std::is_array<T>::value>> : std::integral_constant<std::size_t, sizeof(T)>
+{
+};
+
+// An empty deleter, such as a lambda without captures, is stored as a base
+// class and takes no room in the block.
+template <class T, class D, class RefCount = atomic_ref_count>
+struct control_block_deleter : public basic_control_block_base<RefCount>, public control_block_allocation<T>, private ebo_storage<D>
+{
+   using object_type = T;
+
+   static constexpr std::size_t s_objectBytes = object_size<T>::value;
+
+   control_block_deleter(T* i_pointer, D i_deleter) : basic_control_block_base<RefCount>(this), ebo_storage<D>(i_deleter), m_pointer(i_pointer)
+   {
+   }
+
+   void destroy()
+   {
+      deleter()(m_pointer);
+   }
+
+   template<class Block>
+   static void deallocate(Block* i_block)
+   {
+      delete i_block;
+   }
+
+   static void* get_deleter(control_block_deleter* i_block, const std::type_info& i_type)
+   {
+      return i_type == typeid(D) ? &i_block->deleter() : nullptr;
+   }
+
+   D& deleter()
+   {
+      return ebo_storage<D>::value();
+   }
+
+   T* m_pointer;
+};
+
+template <class T, class RefCount = atomic_ref_count>
+struct control_block : public basic_control_block_base<RefCount>, public control_block_allocation<T>
+{
+   using element_type = std::remove_extent_t<T>;
+   using object_type = T;
+
+   static constexpr std::size_t s_objectBytes = object_size<T>::value;
+
+   control_block(element_type* i_pointer) : basic_control_block_base<RefCount>(this), m_pointer(i_pointer)
+   {
+   }
+
+   void destroy()
+   {
+      if constexpr (std::is_array<T>::value) delete[] m_pointer;
+      else delete m_pointer;
+   }
+
+   template<class Block>
+   static void deallocate(Block* i_block)
+   {
+      delete i_block;
+   }
+
+   element_type* get()
+   {
+      return m_pointer;
+   }
+
+   element_type* m_pointer;
+};
+
+// Selects default initialization in the control blocks that construct their
+// object, for make_shared_for_overwrite.
+struct for_overwrite_t
+{
+};
+
+template <class T, class RefCount = atomic_ref_count>
+struct control_block_element : public basic_control_block_base<RefCount>, public control_block_allocation<T>
+{
+   using object_type = T;
+
+   template<class... ParamTypes>
+   control_block_element(ParamTypes&&... i_params) : basic_control_block_base<RefCount>(this)
+   {
+      new (&m_data) T(std::forward<ParamTypes>(i_params)...);
+   }
+
+   explicit control_block_element(for_overwrite_t) : basic_control_block_base<RefCount>(this)
+   {
+      new (&m_data) T;
+   }
+
+   static constexpr bool s_destroysNothing = std::is_trivially_destructible<T>::value;
+
+   void destroy()
+   {
+      reinterpret_cast<T*>(&m_data)->~T();
+   }
+
+   template<class Block>
+   static void deallocate(Block* i_block)
+   {
+      delete i_block;
+   }
+
+   T* get()
+   {
+      return reinterpret_cast<T*>(&m_data);
+   }
+
+   typename std::aligned_storage<sizeof(T), std::alignment_of<T>::value>::type m_data;
+};
+
+// Like control_block_element, but the object starts and ends on cache line
+// boundaries: threads that only read the object never share a line with the
+// counts written by every copy of the pointer.
+template <class T, class RefCount = atomic_ref_count>
+struct control_block_element_padded : public basic_control_block_base<RefCount>, public control_block_allocation<T>
+{
+   using object_type = T;
+
+   static constexpr std::size_t s_alignment = alignof(T) > SHARED_PTR_CACHE_LINE_SIZE ? alignof(T) : SHARED_PTR_CACHE_LINE_SIZE;
+
+   template<class... ParamTypes>
+   control_block_element_padded(ParamTypes&&... i_params) : basic_control_block_base<RefCount>(this)
+   {
+      new (&m_data) T(std::forward<ParamTypes>(i_params)...);
+   }
+
+   static constexpr bool s_destroysNothing = std::is_trivially_destructible<T>::value;
+
+   void destroy()
+   {
+      reinterpret_cast<T*>(&m_data)->~T();
+   }
+
+   template<class Block>
+   static void deallocate(Block* i_block)
+   {
+      delete i_block;
+   }
+
+   T* get()
    {
+      return reinterpret_cast<T*>(&m_data);
    }
+
+   typename std::aligned_storage<sizeof(T), s_alignment>::type m_data;
 };
 
-struct control_block_base
+// Control block of make_shared for arrays, T being U[] or U[N]. The elements
+// follow the block in the same allocation, aligned for U; arrays of arrays
+// are laid out as one array of their innermost element type.
+template <class T, class RefCount = atomic_ref_count>
+struct control_block_array : public basic_control_block_base<RefCount>
 {
-   virtual ~control_block_base() = default;
-   virtual void destroy() = 0;
+   using element_type = std::remove_extent_t<T>;
+   using object_type = T;
+   using scalar_type = std::remove_all_extents_t<T>;
 
-   std::atomic<long> m_weakRefCount = 0;
-   std::atomic<long> m_refCount = 0;
-};
+   static const std::size_t s_scalarsPerElement = sizeof(element_type) / sizeof(scalar_type);
+   static const std::size_t s_alignment = alignof(scalar_type) > alignof(basic_control_block_base<RefCount>) ? alignof(scalar_type) : alignof(basic_control_block_base<RefCount>);
 
-template <class T, class D>
-struct control_block_deleter : public control_block_base
-{
-   control_block_deleter(T* i_pointer, D i_deleter) : m_pointer(i_pointer), m_deleter(i_deleter)
+   // Allocates the block and constructs i_count elements, each of their
+   // scalars by calling i_construct with its address.
+   template<class Construct>
+   static control_block_array* create(std::size_t i_count, Construct i_construct)
    {
+      if (i_count > (std::size_t(-1) - elements_offset()) / sizeof(element_type)) throw std::bad_array_new_length();
+
+      std::size_t scalarCount = i_count * s_scalarsPerElement;
+      void* memory = allocate_memory(allocation_size(scalarCount));
+      auto block = ::new (memory) control_block_array(scalarCount);
+      std::size_t constructed = 0;
+      try
+      {
+         for (; constructed < scalarCount; constructed++) i_construct(block->scalars() + constructed);
+      }
+      catch (...)
+      {
+         block->destroy_scalars(constructed);
+         block->~control_block_array();
+         deallocate_memory(memory, allocation_size(scalarCount));
+         throw;
+      }
+#if SHARED_PTR_ACCOUNTING
+      block->account(type_accounting::bytes, static_cast<long long>(allocation_size(scalarCount) - sizeof(control_block_array)));
+#endif
+      return block;
    }
 
-   virtual void destroy() override
+   static constexpr bool s_destroysNothing = std::is_trivially_destructible<scalar_type>::value;
+
+   void destroy()
    {
-      m_deleter(m_pointer);
-      m_pointer = nullptr;
+      destroy_scalars(m_scalarCount);
    }
 
-   ~control_block_deleter()
+   static void deallocate(control_block_array* i_block)
    {
-      if (m_pointer) destroy();
+      std::size_t size = allocation_size(i_block->m_scalarCount);
+#if SHARED_PTR_ACCOUNTING
+      i_block->account(type_accounting::bytes, -static_cast<long long>(size - sizeof(control_block_array)));
+#endif
+      i_block->~control_block_array();
+      deallocate_memory(i_block, size);
    }
 
-   T* m_pointer;
-   D m_deleter;
-};
+   element_type* get()
+   {
+      return reinterpret_cast<element_type*>(scalars());
+   }
 
-template <class T>
-struct control_block : public control_block_base
-{
-   control_block(T* i_pointer) : m_pointer(i_pointer)
+   std::size_t m_scalarCount;
+
+private:
+   explicit control_block_array(std::size_t i_scalarCount) : basic_control_block_base<RefCount>(this), m_scalarCount(i_scalarCount)
    {
    }
 
-   virtual void destroy() override
+   static std::size_t elements_offset()
    {
-      delete m_pointer;
-      m_pointer = nullptr;
+      return (sizeof(control_block_array) + alignof(scalar_type) - 1) / alignof(scalar_type) * alignof(scalar_type);
    }
 
-   ~control_block()
+   static std::size_t allocation_size(std::size_t i_scalarCount)
    {
-      if (m_pointer)  destroy();
+      return elements_offset() + i_scalarCount * sizeof(scalar_type);
    }
 
-   T* get()
+   static void* allocate_memory(std::size_t i_size)
    {
-      return m_pointer;
+      if (s_alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__) return ::operator new(i_size, std::align_val_t(s_alignment));
+      return ::operator new(i_size);
    }
 
-   T* m_pointer;
+   static void deallocate_memory(void* i_memory, std::size_t i_size)
+   {
+      if (s_alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__) ::operator delete(i_memory, i_size, std::align_val_t(s_alignment));
+      else ::operator delete(i_memory, i_size);
+   }
+
+   scalar_type* scalars()
+   {
+      return reinterpret_cast<scalar_type*>(reinterpret_cast<char*>(this) + elements_offset());
+   }
+
+   // In reverse order of construction.
+   void destroy_scalars(std::size_t i_count)
+   {
+      if (std::is_trivially_destructible<scalar_type>::value) return;
+      while (i_count > 0) scalars()[--i_count].~scalar_type();
+   }
 };
 
-template <class T>
-struct control_block_element : public control_block_base
+// Frees an allocator aware control block through a copy of its own allocator,
+// rebound to the block type.
+template <class Block, class Alloc>
+void deallocate_control_block(Block* i_block, Alloc& i_alloc)
 {
-   template<class... ParamTypes>
-   control_block_element(ParamTypes&&... i_params)
+   using block_allocator = typename std::allocator_traits<Alloc>::template rebind_alloc<Block>;
+   using block_pointer = typename std::allocator_traits<block_allocator>::pointer;
+
+   block_allocator blockAlloc(i_alloc);
+   i_block->~Block();
+   std::allocator_traits<block_allocator>::deallocate(blockAlloc, std::pointer_traits<block_pointer>::pointer_to(*i_block), 1);
+}
+
+template <class Block, class Alloc, class... ParamTypes>
+Block* allocate_control_block(const Alloc& i_alloc, ParamTypes&&... i_params)
+{
+   using block_allocator = typename std::allocator_traits<Alloc>::template rebind_alloc<Block>;
+
+   block_allocator blockAlloc(i_alloc);
+   auto memory = std::allocator_traits<block_allocator>::allocate(blockAlloc, 1);
+   try
    {
-      new (&m_data) T(std::forward<ParamTypes>(i_params)...);
+      return ::new (static_cast<void*>(std::addressof(*memory))) Block(i_alloc, std::forward<ParamTypes>(i_params)...);
+   }
+   catch (...)
+   {
+      std::allocator_traits<block_allocator>::deallocate(blockAlloc, memory, 1);
+      throw;
    }
+}
 
-   virtual void destroy() override
+template <class T, class D, class Alloc, class RefCount = atomic_ref_count>
+struct control_block_deleter_alloc : public control_block_deleter<T, D, RefCount>, private ebo_storage<Alloc>
+{
+   // The allocator may be a base class, keep its members out of the way.
+   using control_block_deleter<T, D, RefCount>::destroy;
+   using control_block_deleter<T, D, RefCount>::deleter;
+
+   control_block_deleter_alloc(const Alloc& i_alloc, T* i_pointer, D i_deleter) : control_block_deleter<T, D, RefCount>(i_pointer, i_deleter), ebo_storage<Alloc>(i_alloc)
    {
-      reinterpret_cast<T*>(&m_data)->~T();
-      m_wasDestroyed = true;
+      this->use_operations_of(this);
+   }
+
+   static void deallocate(control_block_deleter_alloc* i_block)
+   {
+      Alloc alloc(i_block->ebo_storage<Alloc>::value());
+      deallocate_control_block(i_block, alloc);
    }
+};
+
+template <class T, class Alloc, class RefCount = atomic_ref_count>
+struct control_block_element_alloc : public control_block_element<T, RefCount>, private ebo_storage<Alloc>
+{
+   using control_block_element<T, RefCount>::destroy;
+   using control_block_element<T, RefCount>::get;
+   using control_block_element<T, RefCount>::s_destroysNothing;
 
-   ~control_block_element()
+   template<class... ParamTypes>
+   control_block_element_alloc(const Alloc& i_alloc, ParamTypes&&... i_params) : control_block_element<T, RefCount>(std::forward<ParamTypes>(i_params)...), ebo_storage<Alloc>(i_alloc)
    {
-      if (!m_wasDestroyed) destroy();
+      this->use_operations_of(this);
    }
 
-   T* get()
+   static void deallocate(control_block_element_alloc* i_block)
    {
-      return reinterpret_cast<T*>(&m_data);
+      Alloc alloc(i_block->ebo_storage<Alloc>::value());
+      deallocate_control_block(i_block, alloc);
    }
+};
 
-   bool m_wasDestroyed = false;
-   typename std::aligned_storage<sizeof(T), std::alignment_of<T>::value>::type m_data;
+// Whether a shared_ptr<T> may take ownership of a TOther*. An array owner
+// takes a pointer to its own element type only, up to qualifiers: an array
+// of Derived is not an array of Base.
+template<class TOther, class T>
+struct is_ownable_as : std::true_type
+{
 };
 
-template <class T>
+template<class TOther, class T>
+struct is_ownable_as<TOther, T[]> : std::is_convertible<TOther(*)[], T(*)[]>
+{
+};
+
+template<class TOther, class T, std::size_t N>
+struct is_ownable_as<TOther, T[N]> : std::is_convertible<TOther(*)[N], T(*)[N]>
+{
+};
+
+template <class T, class RefCount>
 class shared_ptr
 {
 public:
 
-   using element_type = T;
+   using element_type = std::remove_extent_t<T>;
+   using control_block_type = basic_control_block_base<RefCount>;
 
-   shared_ptr()
-   {
-      internal_reset(nullptr, nullptr);
-   }
+   constexpr shared_ptr() noexcept = default;
 
-   template<class TOther>
+   template<class TOther, class = std::enable_if_t<is_ownable_as<TOther, T>::value>>
    explicit shared_ptr(TOther* i_pointer)
    {
       try
       {
-         internal_reset(i_pointer, nullptr);
+         internal_reset(i_pointer, i_pointer ? new control_block<T, RefCount>(i_pointer) : nullptr);
       }
       catch (...)
       {
-         delete i_pointer;
+         if constexpr (std::is_array<T>::value) delete[] i_pointer;
+         else delete i_pointer;
          throw;
       }
+      enable_weak_this(i_pointer, this);
    }
 
    template<class TOther, class TDeleter>
    shared_ptr(TOther* i_ptr, TDeleter i_deleter)
    {
       internal_reset_deleter(i_ptr, i_deleter);
+      enable_weak_this(i_ptr, this);
    }
 
    template <class TDeleter>
-   shared_ptr(nullptr_t, TDeleter i_deleter)
+   shared_ptr(std::nullptr_t, TDeleter i_deleter)
    {
       internal_reset_deleter(nullptr, i_deleter);
    }
 
+   template<class TOther, class TDeleter, class TAlloc>
+   shared_ptr(TOther* i_ptr, TDeleter i_deleter, TAlloc i_alloc)
+   {
+      internal_reset_deleter(i_ptr, i_deleter, i_alloc);
+      enable_weak_this(i_ptr, this);
+   }
+
+   template <class TDeleter, class TAlloc>
+   shared_ptr(std::nullptr_t, TDeleter i_deleter, TAlloc i_alloc)
+   {
+      internal_reset_deleter(nullptr, i_deleter, i_alloc);
+   }
+
    template<class TOther> 
-   shared_ptr(const shared_ptr<TOther>& i_otherShared, T* i_otherPtr)
+   shared_ptr(const shared_ptr<TOther, RefCount>& i_otherShared, element_type* i_otherPtr) noexcept
    {
-      if (i_otherShared.get_control_block() && i_otherPtr == nullptr) ++i_otherShared.get_control_block()->m_refCount;
       internal_reset(i_otherPtr, i_otherShared.get_control_block());
    }
 
-   shared_ptr(const shared_ptr& i_other)
+   // Takes over the reference of i_otherShared instead of adding one.
+   template<class TOther>
+   shared_ptr(shared_ptr<TOther, RefCount>&& i_otherShared, element_type* i_otherPtr) noexcept
+   {
+      set_pointers(i_otherPtr, i_otherShared.m_controlBlock);
+      i_otherShared.set_pointers(nullptr, nullptr);
+   }
+
+   shared_ptr(const shared_ptr& i_other) noexcept
    {
       internal_reset(i_other.m_pointer, i_other.m_controlBlock);
    }
 
    template<class TOther, class = std::enable_if_t<std::is_convertible<TOther*, T*>::value>>
-   shared_ptr(const shared_ptr<TOther>& i_other)
+   shared_ptr(const shared_ptr<TOther, RefCount>& i_other) noexcept
    {
       internal_reset(i_other.get(), i_other.get_control_block());
    }
 
-   shared_ptr(shared_ptr&& i_other)
+   shared_ptr(shared_ptr&& i_other) noexcept
    {
       set_pointers(i_other.m_pointer, i_other.m_controlBlock);
       i_other.set_pointers(nullptr, nullptr);
    }
 
    template<class TOther, class = std::enable_if_t<std::is_convertible<TOther*, T*>::value>>
-   shared_ptr(shared_ptr<TOther>&& i_other)
+   shared_ptr(shared_ptr<TOther, RefCount>&& i_other) noexcept
    {
       set_pointers(i_other.m_pointer, i_other.m_controlBlock);
       i_other.set_pointers(nullptr, nullptr);
    }
 
    template<class TOther>
-   explicit shared_ptr(const weak_ptr<TOther>& i_other)
+   explicit shared_ptr(const weak_ptr<TOther, RefCount>& i_other)
    {
-      if (i_other.expired()) throw bad_weak_ptr();
-      internal_reset(i_other.get_ptr(), i_other.get_control_block());
+      if (!i_other.get_control_block() || !i_other.get_control_block()->try_add_ref()) throw bad_weak_ptr();
+      set_pointers(i_other.get_ptr(), i_other.get_control_block());
    }
 
-   shared_ptr(nullptr_t) : shared_ptr()
+   constexpr shared_ptr(std::nullptr_t) noexcept
    {
    }
 
-   ~shared_ptr()
+   ~shared_ptr() noexcept
    {
       remove_ref();
    }
 
-   shared_ptr& operator = (const shared_ptr& i_other)
+   shared_ptr& operator = (const shared_ptr& i_other) noexcept
    {
       shared_ptr(i_other).swap(*this);
       return *this;
    }
 
    template<class TOther>
-   shared_ptr& operator=(const shared_ptr<TOther>& i_other)
+   shared_ptr& operator=(const shared_ptr<TOther, RefCount>& i_other) noexcept
    {
       shared_ptr(i_other).swap(*this);
       return *this;
    }
 
-   shared_ptr& operator = (shared_ptr&& i_other)
+   shared_ptr& operator = (shared_ptr&& i_other) noexcept
    {
       shared_ptr(std::move(i_other)).swap(*this);
       return *this;
    }
 
    template <class TOther>
-   shared_ptr& operator = (shared_ptr<TOther>&& i_other)
+   shared_ptr& operator = (shared_ptr<TOther, RefCount>&& i_other) noexcept
    {
-      shared_ptr(i_other).swap(*this);
+      shared_ptr(std::move(i_other)).swap(*this);
       return *this;
    }
 
-   void swap(shared_ptr& i_other)
+   void swap(shared_ptr& i_other) noexcept
    {
       std::swap(m_pointer, i_other.m_pointer);
       std::swap(m_controlBlock, i_other.m_controlBlock);
    }
 
-   void reset()
+   void reset() noexcept
    {
       shared_ptr().swap(*this);
    }
@@ -234,24 +1184,35 @@ public:
       shared_ptr(i_ptr, i_deleter).swap(*this);
    }
 
-   T* get() const
+   template<class TOther, class TDeleter, class TAlloc>
+   void reset(TOther* i_ptr, TDeleter i_deleter, TAlloc i_alloc)
+   {
+      shared_ptr(i_ptr, i_deleter, i_alloc).swap(*this);
+   }
+
+   element_type* get() const noexcept
    {
       return m_pointer;
    }
 
-   T& operator*()
+   std::add_lvalue_reference_t<element_type> operator*()
    {
       return *m_pointer;
    }
 
-   T* operator ->()
+   element_type* operator ->()
    {
       return m_pointer;
    }
 
-   long use_count() const
+   std::add_lvalue_reference_t<element_type> operator[](std::ptrdiff_t i_index) const
+   {
+      return m_pointer[i_index];
+   }
+
+   long use_count() const noexcept
    {
-      return m_controlBlock ? m_controlBlock->m_refCount.load() : 0;
+      return m_controlBlock ? m_controlBlock->use_count() : 0;
    }
 
    bool unique()
@@ -259,63 +1220,78 @@ public:
       return use_count() == 1;
    }
 
-   explicit operator bool()
+   explicit operator bool() noexcept
    {
       return m_pointer != nullptr;
    }
 
-   control_block_base* get_control_block() const
+   control_block_type* get_control_block() const noexcept
    {
       return m_controlBlock;
    }
 
-   void internal_reset(T* i_pointer, control_block_base* i_controlBlock)
+   // Adds a reference to i_controlBlock, if any. Only the raw pointer
+   // constructors create an owner, so a copy never allocates.
+   void internal_reset(element_type* i_pointer, control_block_type* i_controlBlock) noexcept
    {
       remove_ref();
       set_pointers(i_pointer, i_controlBlock);
-      if (m_pointer)add_ref();
+      add_ref();
    }
 
    template<class TOther>
-   bool owner_before(shared_ptr<TOther> const& i_other) const
+   bool owner_before(shared_ptr<TOther, RefCount> const& i_other) const
    {
-      return m_controlBlock < i_other.m_controlBlock;
+      return m_controlBlock < i_other.get_control_block();
    }
 
    template<class TOther>
-   bool owner_before(weak_ptr<TOther> const& i_other) const
+   bool owner_before(weak_ptr<TOther, RefCount> const& i_other) const
    {
-      return m_controlBlock < i_other.m_controlBlock;
+      return m_controlBlock < i_other.get_control_block();
    }
 
 private:
-   void add_ref()
+   template<class TOther, class TOtherRefCount>
+   friend class shared_ptr;
+
+   template<class TOther, class TOtherRefCount>
+   friend class weak_ptr;
+
+   template<class TDerived, class TOtherRefCount>
+   friend class intrusive_weak_ref_counter;
+
+   void add_ref() noexcept
    {
-      if (!m_controlBlock) m_controlBlock = new control_block<T>(m_pointer);
-      ++m_controlBlock->m_refCount;
+      if (m_controlBlock) m_controlBlock->add_ref();
    }
 
-   void remove_ref()
+   void remove_ref() noexcept
    {
-      if (!m_controlBlock || --m_controlBlock->m_refCount != 0) return;
+      if (m_controlBlock) m_controlBlock->release();
+   }
 
-      if (m_controlBlock->m_weakRefCount == 0)
+   template<class TDeleter>
+   void internal_reset_deleter(element_type* i_pointer, TDeleter i_deleter)
+   {
+      try
       {
-         delete m_controlBlock;
-         m_controlBlock = nullptr;
+         internal_reset(i_pointer, i_pointer ? new control_block_deleter<element_type, TDeleter, RefCount>(i_pointer, i_deleter) : nullptr);
       }
-      else
+      catch (...)
       {
-         m_controlBlock->destroy();
+         if (i_pointer) i_deleter(i_pointer);
+         throw;
       }
    }
 
-   template<class TDeleter>
-   void internal_reset_deleter(T* i_pointer, TDeleter i_deleter)
+   template<class TDeleter, class TAlloc>
+   void internal_reset_deleter(element_type* i_pointer, TDeleter i_deleter, const TAlloc& i_alloc)
    {
       try
       {
-         internal_reset(i_pointer, new control_block_deleter<T, TDeleter>(i_pointer, i_deleter));
+         using block_type = control_block_deleter_alloc<element_type, TDeleter, TAlloc, RefCount>;
+         internal_reset(i_pointer, i_pointer ? allocate_control_block<block_type>(i_alloc, i_pointer, i_deleter) : nullptr);
       }
       catch (...)
       {
@@ -324,242 +1300,474 @@ private:
       }
    }
 
-   void set_pointers(T* i_pointer, control_block_base* i_controlBlock)
+   void set_pointers(element_type* i_pointer, control_block_type* i_controlBlock) noexcept
    {
       m_pointer = i_pointer;
       m_controlBlock = i_controlBlock;
    }
 
 private:
-   T* m_pointer = nullptr;
-   control_block_base* m_controlBlock = nullptr;
+   element_type* m_pointer = nullptr;
+   control_block_type* m_controlBlock = nullptr;
 };
 
-template <class ObjectType, class... ParamTypes>
+// Pointers for object graphs that never leave one thread: the same control
+// blocks, with plain counters instead of atomic ones.
+template <class T>
+using local_shared_ptr = shared_ptr<T, local_ref_count>;
+
+template <class T>
+using local_weak_ptr = weak_ptr<T, local_ref_count>;
+
+// Pointers to objects copied on every thread, with the strong count sharded.
+// The control block takes a cache line per shard.
+template <class T>
+using sharded_shared_ptr = shared_ptr<T, sharded_ref_count>;
+
+template <class T>
+using sharded_weak_ptr = weak_ptr<T, sharded_ref_count>;
+
+template <class ObjectType, class RefCount, class... ParamTypes>
+shared_ptr<ObjectType, RefCount> basic_make_shared(ParamTypes&&... i_params)
+{
+   shared_ptr<ObjectType, RefCount> shared;
+   auto controlBlock = new control_block_element<ObjectType, RefCount>(std::forward<ParamTypes>(i_params)...);
+   shared.internal_reset(controlBlock->get(), controlBlock);
+   enable_weak_this(shared.get(), &shared);
+   return shared;
+}
+
+template <class ObjectType, class... ParamTypes, class = std::enable_if_t<!std::is_array<ObjectType>::value>>
 shared_ptr<ObjectType> make_shared(ParamTypes&&... i_params)
+{
+   return basic_make_shared<ObjectType, atomic_ref_count>(std::forward<ParamTypes>(i_params)...);
+}
+
+template <class ObjectType, class... ParamTypes>
+local_shared_ptr<ObjectType> make_local_shared(ParamTypes&&... i_params)
+{
+   return basic_make_shared<ObjectType, local_ref_count>(std::forward<ParamTypes>(i_params)...);
+}
+
+template <class ObjectType, class... ParamTypes>
+sharded_shared_ptr<ObjectType> make_shared_sharded(ParamTypes&&... i_params)
+{
+   return basic_make_shared<ObjectType, sharded_ref_count>(std::forward<ParamTypes>(i_params)...);
+}
+
+template <class ObjectType, class RefCount, class Construct>
+shared_ptr<ObjectType, RefCount> basic_make_shared_array(std::size_t i_count, Construct i_construct)
+{
+   shared_ptr<ObjectType, RefCount> shared;
+   auto controlBlock = control_block_array<ObjectType, RefCount>::create(i_count, i_construct);
+   shared.internal_reset(controlBlock->get(), controlBlock);
+   return shared;
+}
+
+template<class T>
+using enable_if_unbounded_array_t = std::enable_if_t<std::is_array<T>::value && std::extent<T>::value == 0>;
+
+template<class T>
+using enable_if_bounded_array_t = std::enable_if_t<std::extent<T>::value != 0>;
+
+// Element initializers of the array factories.
+struct value_initialize
+{
+   template<class T>
+   void operator()(T* i_element) const
+   {
+      ::new (static_cast<void*>(i_element)) T();
+   }
+};
+
+struct default_initialize
+{
+   template<class T>
+   void operator()(T* i_element) const
+   {
+      ::new (static_cast<void*>(i_element)) T;
+   }
+};
+
+template<class Value>
+struct copy_initialize
+{
+   template<class T>
+   void operator()(T* i_element) const
+   {
+      ::new (static_cast<void*>(i_element)) T(m_value);
+   }
+
+   const Value& m_value;
+};
+
+// make_shared<U[]>(n) and make_shared<U[N]>(): one allocation for the counts
+// and all the elements, value initialized or copies of i_value.
+template <class ObjectType, class = enable_if_unbounded_array_t<ObjectType>>
+shared_ptr<ObjectType> make_shared(std::size_t i_count)
+{
+   return basic_make_shared_array<ObjectType, atomic_ref_count>(i_count, value_initialize());
+}
+
+template <class ObjectType, class = enable_if_unbounded_array_t<ObjectType>>
+shared_ptr<ObjectType> make_shared(std::size_t i_count, const std::remove_extent_t<ObjectType>& i_value)
+{
+   static_assert(!std::is_array<std::remove_extent_t<ObjectType>>::value, "arrays of arrays are only value initialized");
+   return basic_make_shared_array<ObjectType, atomic_ref_count>(i_count, copy_initialize<std::remove_extent_t<ObjectType>>{ i_value });
+}
+
+template <class ObjectType, class = enable_if_bounded_array_t<ObjectType>>
+shared_ptr<ObjectType> make_shared()
+{
+   return basic_make_shared_array<ObjectType, atomic_ref_count>(std::extent<ObjectType>::value, value_initialize());
+}
+
+template <class ObjectType, class = enable_if_bounded_array_t<ObjectType>>
+shared_ptr<ObjectType> make_shared(const std::remove_extent_t<ObjectType>& i_value)
+{
+   static_assert(!std::is_array<std::remove_extent_t<ObjectType>>::value, "arrays of arrays are only value initialized");
+   return basic_make_shared_array<ObjectType, atomic_ref_count>(std::extent<ObjectType>::value, copy_initialize<std::remove_extent_t<ObjectType>>{ i_value });
+}
+
+// Like make_shared, but the object or the elements are default initialized:
+// trivial types are left uninitialized, for buffers filled right away.
+template <class ObjectType>
+std::enable_if_t<!std::is_array<ObjectType>::value, shared_ptr<ObjectType>> make_shared_for_overwrite()
+{
+   return basic_make_shared<ObjectType, atomic_ref_count>(for_overwrite_t());
+}
+
+template <class ObjectType, class = enable_if_unbounded_array_t<ObjectType>>
+shared_ptr<ObjectType> make_shared_for_overwrite(std::size_t i_count)
+{
+   return basic_make_shared_array<ObjectType, atomic_ref_count>(i_count, default_initialize());
+}
+
+template <class ObjectType, class = enable_if_bounded_array_t<ObjectType>>
+shared_ptr<ObjectType> make_shared_for_overwrite()
+{
+   return basic_make_shared_array<ObjectType, atomic_ref_count>(std::extent<ObjectType>::value, default_initialize());
+}
+
+// Like make_shared, but the object does not share a cache line with the
+// reference counts, at the price of at least one more cache line per object.
+// For objects read on many cores while other threads copy the pointer.
+template <class ObjectType, class... ParamTypes>
+shared_ptr<ObjectType> make_shared_padded(ParamTypes&&... i_params)
 {
    shared_ptr<ObjectType> shared;
-   auto controlBlock = new control_block_element<ObjectType>(std::forward<ParamTypes>(i_params)...);
+   auto controlBlock = new control_block_element_padded<ObjectType>(std::forward<ParamTypes>(i_params)...);
+   shared.internal_reset(controlBlock->get(), controlBlock);
+   enable_weak_this(shared.get(), &shared);
+   return shared;
+}
+
+// Like make_shared, but the control block and the object are allocated and
+// freed through i_alloc, rebound to the control block type.
+template <class ObjectType, class RefCount, class Alloc, class... ParamTypes>
+shared_ptr<ObjectType, RefCount> basic_allocate_shared(const Alloc& i_alloc, ParamTypes&&... i_params)
+{
+   shared_ptr<ObjectType, RefCount> shared;
+   auto controlBlock = allocate_control_block<control_block_element_alloc<ObjectType, Alloc, RefCount>>(i_alloc, std::forward<ParamTypes>(i_params)...);
    shared.internal_reset(controlBlock->get(), controlBlock);
+   enable_weak_this(shared.get(), &shared);
    return shared;
 }
 
-template<class TLeft, class TRight>
-bool operator==(const shared_ptr<TLeft>& i_lhs, const shared_ptr<TRight>& i_rhs)
+template <class ObjectType, class Alloc, class... ParamTypes>
+shared_ptr<ObjectType> allocate_shared(const Alloc& i_alloc, ParamTypes&&... i_params)
+{
+   return basic_allocate_shared<ObjectType, atomic_ref_count>(i_alloc, std::forward<ParamTypes>(i_params)...);
+}
+
+template <class ObjectType, class Alloc, class... ParamTypes>
+local_shared_ptr<ObjectType> allocate_local_shared(const Alloc& i_alloc, ParamTypes&&... i_params)
+{
+   return basic_allocate_shared<ObjectType, local_ref_count>(i_alloc, std::forward<ParamTypes>(i_params)...);
+}
+
+template<class TLeft, class TRight, class RefCount>
+bool operator==(const shared_ptr<TLeft, RefCount>& i_lhs, const shared_ptr<TRight, RefCount>& i_rhs)
 {
    return i_lhs.get() == i_rhs.get();
 }
 
-template<class TLeft, class TRight>
-bool operator<(const shared_ptr<TLeft>& i_lhs, const shared_ptr<TRight>& i_rhs)
+template<class TLeft, class TRight, class RefCount>
+bool operator<(const shared_ptr<TLeft, RefCount>& i_lhs, const shared_ptr<TRight, RefCount>& i_rhs)
 {
    return std::less<decltype(false ? i_lhs.get() : i_rhs.get())>()(i_lhs.get(), i_rhs.get());
 }
 
-template <class TLeft>
-bool operator==(const shared_ptr<TLeft>& i_lhs, nullptr_t)
+template<class TLeft, class RefCount>
+bool operator==(const shared_ptr<TLeft, RefCount>& i_lhs, std::nullptr_t)
 {
    return !i_lhs;
 }
 
-template <class TRight>
-bool operator==(nullptr_t, const shared_ptr<TRight>& i_rhs)
+template<class TRight, class RefCount>
+bool operator==(std::nullptr_t, const shared_ptr<TRight, RefCount>& i_rhs)
 {
    return !i_rhs;
 }
 
-template <class TLeft>
-bool operator!=(const shared_ptr<TLeft>& i_lhs, nullptr_t)
+template<class TLeft, class RefCount>
+bool operator!=(const shared_ptr<TLeft, RefCount>& i_lhs, std::nullptr_t)
 {
    return static_cast<bool>(i_lhs);
 }
 
-template <class TRight>
-bool operator!=(nullptr_t, const shared_ptr<TRight>& i_rhs)
+template<class TRight, class RefCount>
+bool operator!=(std::nullptr_t, const shared_ptr<TRight, RefCount>& i_rhs)
 {
    return static_cast<bool>(i_rhs);
 }
 
-template <class TLeft>
-bool operator<(const shared_ptr<TLeft>& i_lhs, nullptr_t)
+template<class TLeft, class RefCount>
+bool operator<(const shared_ptr<TLeft, RefCount>& i_lhs, std::nullptr_t)
 {
    return std::less<TLeft*>()(i_lhs.get(), nullptr);
 }
 
-template <class TRight>
-bool operator<(nullptr_t, const shared_ptr<TRight>& i_rhs)
+template<class TRight, class RefCount>
+bool operator<(std::nullptr_t, const shared_ptr<TRight, RefCount>& i_rhs)
 {
    return std::less<TRight*>()(nullptr, i_rhs.get());
 }
 
-template <class TLeft>
-bool operator>(const shared_ptr<TLeft>& i_lhs, nullptr_t)
+template<class TLeft, class RefCount>
+bool operator>(const shared_ptr<TLeft, RefCount>& i_lhs, std::nullptr_t)
 {
    return nullptr < i_lhs;
 }
 
-template <class TRight>
-bool operator>(nullptr_t, const shared_ptr<TRight>& i_rhs)
+template<class TRight, class RefCount>
+bool operator>(std::nullptr_t, const shared_ptr<TRight, RefCount>& i_rhs)
 {
-   i_rhs < nullptr;
+   return i_rhs < nullptr;
 }
 
-template <class TLeft>
-bool operator<=(const shared_ptr<TLeft>& i_rhs, nullptr_t)
+template<class TLeft, class RefCount>
+bool operator<=(const shared_ptr<TLeft, RefCount>& i_lhs, std::nullptr_t)
 {
-   return !(nullptr < i_rhs);
+   return !(nullptr < i_lhs);
 }
 
-template <class TRight>
-bool operator<=(nullptr_t, const shared_ptr<TRight>& i_lhs)
+template<class TRight, class RefCount>
+bool operator<=(std::nullptr_t, const shared_ptr<TRight, RefCount>& i_rhs)
 {
-   return !(i_lhs < nullptr);
+   return !(i_rhs < nullptr);
 }
 
-template <class TLeft>
-bool operator>=(const shared_ptr<TLeft>& i_rhs, nullptr_t)
+template<class TLeft, class RefCount>
+bool operator>=(const shared_ptr<TLeft, RefCount>& i_lhs, std::nullptr_t)
 {
    return !(i_lhs < nullptr);
 }
 
-template <class TRight>
-bool operator>=(nullptr_t, const shared_ptr<TRight>& i_lhs)
+template<class TRight, class RefCount>
+bool operator>=(std::nullptr_t, const shared_ptr<TRight, RefCount>& i_rhs)
 {
    return !(nullptr < i_rhs);
 }
 
-template<class T>
-void swap(shared_ptr<T>& i_lhs, shared_ptr<T>& i_rhs)
+template<class T, class RefCount>
+void swap(shared_ptr<T, RefCount>& i_lhs, shared_ptr<T, RefCount>& i_rhs) noexcept
 {
    i_lhs.swap(i_rhs);
 }
 
-template<class T, class TOther>
-shared_ptr<T> static_pointer_cast(const shared_ptr<TOther>& i_ptr)
+template<class T, class TOther, class RefCount>
+shared_ptr<T, RefCount> static_pointer_cast(const shared_ptr<TOther, RefCount>& i_ptr)
 {
-   return shared_ptr<T>(i_ptr, static_cast<T*>(i_ptr.get()));
+   return shared_ptr<T, RefCount>(i_ptr, static_cast<typename shared_ptr<T, RefCount>::element_type*>(i_ptr.get()));
 }
 
-template<class T, class TOther>
-shared_ptr<T> dynamic_pointer_cast(const shared_ptr<TOther>& i_ptr)
+template<class T, class TOther, class RefCount>
+shared_ptr<T, RefCount> dynamic_pointer_cast(const shared_ptr<TOther, RefCount>& i_ptr)
 {
-   return dynamic_cast<T*>(i_ptr.get()) == nullptr ? shared_ptr<T>() : shared_ptr<T>(i_ptr, dynamic_cast<T*>(i_ptr.get()));
+   auto pointer = dynamic_cast<typename shared_ptr<T, RefCount>::element_type*>(i_ptr.get());
+   return pointer ? shared_ptr<T, RefCount>(i_ptr, pointer) : shared_ptr<T, RefCount>();
 }
 
-template<class T, class TOther>
-shared_ptr<T> const_pointer_cast(const shared_ptr<TOther>& i_ptr)
+template<class T, class TOther, class RefCount>
+shared_ptr<T, RefCount> const_pointer_cast(const shared_ptr<TOther, RefCount>& i_ptr)
 {
-   return shared_ptr<T>(i_ptr, const_cast<T*>(i_ptr.get()));
+   return shared_ptr<T, RefCount>(i_ptr, const_cast<typename shared_ptr<T, RefCount>::element_type*>(i_ptr.get()));
 }
 
-template<class T, class TDeleter>
-TDeleter* get_deleter(const shared_ptr<T>& i_ptr)
+// The casts of an rvalue hand its reference over to the result, which leaves
+// the counts alone.
+template<class T, class TOther, class RefCount>
+shared_ptr<T, RefCount> static_pointer_cast(shared_ptr<TOther, RefCount>&& i_ptr)
 {
-   auto controlBlock = dynamic_cast<control_block_deleter*>(i_ptr.get_control_block());
-   return &(controlBlock->m_deleter);
+   auto pointer = static_cast<typename shared_ptr<T, RefCount>::element_type*>(i_ptr.get());
+   return shared_ptr<T, RefCount>(std::move(i_ptr), pointer);
 }
 
-template<class T>
+// i_ptr keeps its reference if the cast fails.
+template<class T, class TOther, class RefCount>
+shared_ptr<T, RefCount> dynamic_pointer_cast(shared_ptr<TOther, RefCount>&& i_ptr)
+{
+   auto pointer = dynamic_cast<typename shared_ptr<T, RefCount>::element_type*>(i_ptr.get());
+   return pointer ? shared_ptr<T, RefCount>(std::move(i_ptr), pointer) : shared_ptr<T, RefCount>();
+}
+
+template<class T, class TOther, class RefCount>
+shared_ptr<T, RefCount> const_pointer_cast(shared_ptr<TOther, RefCount>&& i_ptr)
+{
+   auto pointer = const_cast<typename shared_ptr<T, RefCount>::element_type*>(i_ptr.get());
+   return shared_ptr<T, RefCount>(std::move(i_ptr), pointer);
+}
+
+template<class TDeleter, class T, class RefCount>
+TDeleter* get_deleter(const shared_ptr<T, RefCount>& i_ptr)
+{
+   auto controlBlock = i_ptr.get_control_block();
+   return controlBlock ? static_cast<TDeleter*>(controlBlock->get_deleter(typeid(TDeleter))) : nullptr;
+}
+
+template<class T, class RefCount>
 class weak_ptr 
 {
 public:
-   typedef T element_type;
+   using element_type = std::remove_extent_t<T>;
+   using control_block_type = basic_control_block_base<RefCount>;
 
-   weak_ptr()
-   {
-   }
+   constexpr weak_ptr() noexcept = default;
 
-   weak_ptr(const weak_ptr& i_other)
+   weak_ptr(const weak_ptr& i_other) noexcept
    {
       internal_reset(i_other.m_pointer, i_other.m_controlBlock);
    }
 
    template<class TOther, class = std::enable_if_t<std::is_convertible<TOther*, T*>::value>>
-   weak_ptr(const weak_ptr<TOther>& i_other)
+   weak_ptr(const weak_ptr<TOther, RefCount>& i_other) noexcept
    {
       internal_reset(i_other.get_ptr(), i_other.get_control_block());
    }
 
    template<class TOther, class = std::enable_if_t<std::is_convertible<TOther*, T*>::value>>
-   weak_ptr(const shared_ptr<TOther>& i_ptr)
+   weak_ptr(const shared_ptr<TOther, RefCount>& i_ptr) noexcept
    {
       internal_reset(i_ptr.get(), i_ptr.get_control_block());
    }
 
-   ~weak_ptr()
+   weak_ptr(weak_ptr&& i_other) noexcept
+   {
+      take_over(i_other);
+   }
+
+   template<class TOther, class = std::enable_if_t<std::is_convertible<TOther*, T*>::value>>
+   weak_ptr(weak_ptr<TOther, RefCount>&& i_other) noexcept
+   {
+      take_over(i_other);
+   }
+
+   ~weak_ptr() noexcept
    {
       remove_weak_ref();
    }
 
-   weak_ptr& operator=(const weak_ptr& i_other)
+   weak_ptr& operator=(const weak_ptr& i_other) noexcept
    {
       weak_ptr(i_other).swap(*this);
       return *this;
    }
 
    template<class TOther>
-   weak_ptr& operator=(const weak_ptr<TOther>& i_other)
+   weak_ptr& operator=(const weak_ptr<TOther, RefCount>& i_other) noexcept
    {
       weak_ptr(i_other).swap(*this);
       return *this;
    }
 
    template<class TOther>
-   weak_ptr& operator=(const shared_ptr<TOther>& i_other)
+   weak_ptr& operator=(const shared_ptr<TOther, RefCount>& i_other) noexcept
    {
       weak_ptr(i_other).swap(*this);
       return *this;
    }
 
-   void swap(weak_ptr& i_other)
+   weak_ptr& operator=(weak_ptr&& i_other) noexcept
+   {
+      weak_ptr(std::move(i_other)).swap(*this);
+      return *this;
+   }
+
+   template<class TOther>
+   weak_ptr& operator=(weak_ptr<TOther, RefCount>&& i_other) noexcept
+   {
+      weak_ptr(std::move(i_other)).swap(*this);
+      return *this;
+   }
+
+   void swap(weak_ptr& i_other) noexcept
    {
+      std::swap(m_pointer, i_other.m_pointer);
       std::swap(m_controlBlock, i_other.m_controlBlock);
    }
 
-   void reset()
+   void reset() noexcept
    {
       weak_ptr().swap(*this);
    }
 
-   long use_count() const
+   long use_count() const noexcept
    {
-      return m_controlBlock ? m_controlBlock->m_refCount.load() : 0;
+      return m_controlBlock ? m_controlBlock->use_count() : 0;
    }
 
-   bool expired() const
+   bool expired() const noexcept
    {
       return use_count() == 0;
    }
 
-   shared_ptr<T> lock() const
+   shared_ptr<T, RefCount> lock() const noexcept
    {
-      return expired() ? shared_ptr<T>() : shared_ptr<T>(*this);
+      shared_ptr<T, RefCount> locked;
+      if (m_controlBlock && m_controlBlock->try_add_ref()) locked.set_pointers(m_pointer, m_controlBlock);
+      return locked;
    }
 
-   control_block_base* get_control_block() const
+   control_block_type* get_control_block() const noexcept
    {
       return m_controlBlock;
    }
 
-   T* get_ptr() const
+   element_type* get_ptr() const noexcept
    {
       return m_pointer;
    }
 
 private:
-   void add_weak_ref()
+   template<class TOther, class TOtherRefCount>
+   friend class weak_ptr;
+
+   template<class TBase, class TRefCount, class TOwner>
+   friend void enable_weak_this(const enable_shared_from_this<TBase, TRefCount>* i_base, const shared_ptr<TOwner, TRefCount>* i_owner);
+
+   // Takes over the weak reference of i_other instead of adding one.
+   template<class TOther>
+   void take_over(weak_ptr<TOther, RefCount>& i_other) noexcept
+   {
+      m_pointer = i_other.m_pointer;
+      m_controlBlock = i_other.m_controlBlock;
+      i_other.m_pointer = nullptr;
+      i_other.m_controlBlock = nullptr;
+   }
+
+   void add_weak_ref() noexcept
    {
-      if (m_controlBlock) ++m_controlBlock->m_weakRefCount;
+      if (m_controlBlock) m_controlBlock->add_weak_ref();
    }
 
-   void remove_weak_ref()
+   void remove_weak_ref() noexcept
    {
-      if (!m_controlBlock || --m_controlBlock->m_weakRefCount != 0) return;
-      if (m_controlBlock->m_refCount == 0) delete m_controlBlock;
+      if (m_controlBlock) m_controlBlock->release_weak();
       m_controlBlock = nullptr;
    }
 
-   void internal_reset(T* i_ptr, control_block_base* i_controlBlock)
+   void internal_reset(element_type* i_ptr, control_block_type* i_controlBlock) noexcept
    {
       m_pointer = i_ptr;
       m_controlBlock = i_controlBlock;
@@ -567,6 +1775,69 @@ private:
    }
 
 private:
-   T* m_pointer = nullptr;
-   control_block_base* m_controlBlock = nullptr;
-};
\ No newline at end of file
+   element_type* m_pointer = nullptr;
+   control_block_type* m_controlBlock = nullptr;
+};
+
+// Base class for objects that hand out shared_ptrs to themselves. The
+// shared_ptr that takes ownership of the object fills in the embedded
+// weak_ptr, which shares its control block: a self-reference costs one
+// increment, no allocation.
+template<class T, class RefCount>
+class enable_shared_from_this
+{
+public:
+   shared_ptr<T, RefCount> shared_from_this()
+   {
+      return shared_ptr<T, RefCount>(m_weakThis);
+   }
+
+   shared_ptr<const T, RefCount> shared_from_this() const
+   {
+      return shared_ptr<const T, RefCount>(m_weakThis);
+   }
+
+   weak_ptr<T, RefCount> weak_from_this() noexcept
+   {
+      return m_weakThis;
+   }
+
+   weak_ptr<const T, RefCount> weak_from_this() const noexcept
+   {
+      return m_weakThis;
+   }
+
+protected:
+   enable_shared_from_this() = default;
+
+   // A copy is a different object, owned by whoever owns it.
+   enable_shared_from_this(const enable_shared_from_this&)
+   {
+   }
+
+   enable_shared_from_this& operator=(const enable_shared_from_this&)
+   {
+      return *this;
+   }
+
+   ~enable_shared_from_this() = default;
+
+private:
+   template<class TBase, class TRefCount, class TOwner>
+   friend void enable_weak_this(const enable_shared_from_this<TBase, TRefCount>* i_base, const shared_ptr<TOwner, TRefCount>* i_owner);
+
+   mutable weak_ptr<T, RefCount> m_weakThis;
+};
+
+// An object already owned keeps its first owner. The owner may point to the
+// object as a base class or as const, so the weak_ptr is built from the
+// object and the owner's control block rather than from the owner.
+template<class TBase, class RefCount, class T>
+void enable_weak_this(const enable_shared_from_this<TBase, RefCount>* i_base, const shared_ptr<T, RefCount>* i_owner)
+{
+   if (!i_base || !i_base->m_weakThis.expired()) return;
+
+   weak_ptr<TBase, RefCount> weakThis;
+   weakThis.internal_reset(const_cast<TBase*>(static_cast<const TBase*>(i_base)), i_owner->get_control_block());
+   i_base->m_weakThis = std::move(weakThis);
+}
@@ -0,0 +1,214 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <typeinfo>
+#include <vector>
+
+#ifdef __GNUG__
+#include <cxxabi.h>
+#endif
+
+// Number of types type_accounting tells apart; the types registered after
+// them are counted together under "other".
+#ifndef SHARED_PTR_ACCOUNTING_MAX_TYPES
+#define SHARED_PTR_ACCOUNTING_MAX_TYPES 256
+#endif
+
+struct type_accounting_entry
+{
+   std::string m_type;
+   long long m_liveObjects;
+   long long m_liveBlocks;
+   // Blocks whose object is destroyed, kept alive by weak_ptrs only.
+   long long m_zombieBlocks;
+   long long m_bytes;
+   // Highest byte count a snapshot saw, not a peak: a spike between two
+   // snapshots does not show.
+   long long m_maxSampledBytes;
+};
+
+// Per type counts of the objects and control blocks of the library, filled
+// in by the control blocks when SHARED_PTR_ACCOUNTING is 1:
+//  - every thread adds to counters of its own, with plain stores and no
+//    read-modify-write, so counting costs next to nothing;
+//  - snapshot() merges the counters of all threads on demand.
+// Bytes are those of the control blocks, which hold the objects of
+// make_shared and allocate_shared, plus those of the objects a block owns
+// through a plain pointer. Keeping a true peak would take a shared
+// read-modify-write per change, so snapshots only record the highest byte
+// count they saw.
+class type_accounting
+{
+public:
+   enum counter
+   {
+      live_blocks,
+      zombie_blocks,
+      bytes,
+      counter_count
+   };
+
+   // Slot of the counters of T, assigned on first use.
+   template<class T>
+   static std::size_t slot_of()
+   {
+      static const std::size_t slot = register_type(typeid(T));
+      return slot;
+   }
+
+   static void add(std::size_t i_slot, counter i_counter, long long i_delta)
+   {
+      std::atomic<long long>& count = local_record().m_counts[i_slot][i_counter];
+      count.store(count.load(std::memory_order_relaxed) + i_delta, std::memory_order_relaxed);
+   }
+
+   // Totals of every type that was counted, the largest holders of memory
+   // first.
+   static std::vector<type_accounting_entry> snapshot()
+   {
+      std::size_t typeCount = std::min<std::size_t>(s_typeCount.load(std::memory_order_acquire), SHARED_PTR_ACCOUNTING_MAX_TYPES);
+      std::vector<type_accounting_entry> entries;
+      for (std::size_t slot = 0; slot < typeCount; slot++)
+      {
+         long long totals[counter_count] = {};
+         for (thread_record* record = s_records.load(std::memory_order_acquire); record; record = record->m_next)
+         {
+            for (int i = 0; i < counter_count; i++) totals[i] += record->m_counts[slot][i].load(std::memory_order_relaxed);
+         }
+
+         long long maxSampled = s_maxSampledBytes[slot].load(std::memory_order_relaxed);
+         while (totals[bytes] > maxSampled && !s_maxSampledBytes[slot].compare_exchange_weak(maxSampled, totals[bytes], std::memory_order_relaxed))
+         {
+         }
+         maxSampled = std::max(maxSampled, totals[bytes]);
+         if (slot == 0 && maxSampled == 0) continue;
+
+         const std::type_info* type = s_types[slot].load(std::memory_order_acquire);
+         entries.push_back(type_accounting_entry{ type ? type_name(*type) : "other", totals[live_blocks] - totals[zombie_blocks], totals[live_blocks], totals[zombie_blocks], totals[bytes], maxSampled });
+      }
+      std::stable_sort(entries.begin(), entries.end(), [](const type_accounting_entry& i_lhs, const type_accounting_entry& i_rhs) { return i_lhs.m_bytes > i_rhs.m_bytes; });
+      return entries;
+   }
+
+   static std::string to_text(const std::vector<type_accounting_entry>& i_entries)
+   {
+      std::string text = "live_objects live_blocks zombie_blocks bytes max_sampled_bytes type\n";
+      for (const auto& entry : i_entries)
+      {
+         char line[128];
+         std::snprintf(line, sizeof(line), "%12lld %11lld %13lld %12lld %17lld ", entry.m_liveObjects, entry.m_liveBlocks, entry.m_zombieBlocks, entry.m_bytes, entry.m_maxSampledBytes);
+         text += line + entry.m_type + "\n";
+      }
+      return text;
+   }
+
+   static std::string to_json(const std::vector<type_accounting_entry>& i_entries)
+   {
+      std::string json = "[";
+      for (const auto& entry : i_entries)
+      {
+         if (json.size() > 1) json += ",";
+         json += "{\"type\":\"" + escape(entry.m_type) + "\"";
+         json += ",\"live_objects\":" + std::to_string(entry.m_liveObjects);
+         json += ",\"live_blocks\":" + std::to_string(entry.m_liveBlocks);
+         json += ",\"zombie_blocks\":" + std::to_string(entry.m_zombieBlocks);
+         json += ",\"bytes\":" + std::to_string(entry.m_bytes);
+         json += ",\"max_sampled_bytes\":" + std::to_string(entry.m_maxSampledBytes) + "}";
+      }
+      return json + "]";
+   }
+
+private:
+   struct thread_record
+   {
+      std::atomic<long long> m_counts[SHARED_PTR_ACCOUNTING_MAX_TYPES][counter_count] = {};
+      std::atomic<bool> m_inUse{ true };
+      thread_record* m_next = nullptr;
+   };
+
+   // Records are reused by later threads and never freed, so the counts of
+   // exited threads stay in the totals.
+   static thread_record* acquire_record()
+   {
+      for (thread_record* record = s_records.load(std::memory_order_acquire); record; record = record->m_next)
+      {
+         bool inUse = false;
+         if (record->m_inUse.compare_exchange_strong(inUse, true, std::memory_order_acquire)) return record;
+      }
+
+      thread_record* record = new thread_record;
+      record->m_next = s_records.load(std::memory_order_relaxed);
+      while (!s_records.compare_exchange_weak(record->m_next, record, std::memory_order_release, std::memory_order_relaxed))
+      {
+      }
+      return record;
+   }
+
+   struct thread_record_holder
+   {
+      ~thread_record_holder()
+      {
+         if (t_record) t_record->m_inUse.store(false, std::memory_order_release);
+         t_record = nullptr;
+      }
+   };
+
+   // Blocks released by thread_local destructors that run after the holder
+   // acquire a record again, which then stays with the exiting thread.
+   static thread_record& local_record()
+   {
+      if (!t_record)
+      {
+         t_record = acquire_record();
+         thread_local thread_record_holder holder;
+      }
+      return *t_record;
+   }
+
+   static std::size_t register_type(const std::type_info& i_type)
+   {
+      std::size_t slot = s_typeCount.fetch_add(1, std::memory_order_relaxed);
+      if (slot >= SHARED_PTR_ACCOUNTING_MAX_TYPES) return 0;
+
+      s_types[slot].store(&i_type, std::memory_order_release);
+      return slot;
+   }
+
+   static std::string type_name(const std::type_info& i_type)
+   {
+#ifdef __GNUG__
+      int status = 0;
+      char* demangled = abi::__cxa_demangle(i_type.name(), nullptr, nullptr, &status);
+      if (status == 0 && demangled)
+      {
+         std::string name = demangled;
+         std::free(demangled);
+         return name;
+      }
+#endif
+      return i_type.name();
+   }
+
+   static std::string escape(const std::string& i_text)
+   {
+      std::string escaped;
+      for (char character : i_text)
+      {
+         if (character == '"' || character == '\\') escaped += '\\';
+         escaped += character;
+      }
+      return escaped;
+   }
+
+   // Slot 0 collects the types past SHARED_PTR_ACCOUNTING_MAX_TYPES.
+   static inline std::atomic<std::size_t> s_typeCount{ 1 };
+   static inline std::atomic<const std::type_info*> s_types[SHARED_PTR_ACCOUNTING_MAX_TYPES] = {};
+   static inline std::atomic<long long> s_maxSampledBytes[SHARED_PTR_ACCOUNTING_MAX_TYPES] = {};
+   static inline std::atomic<thread_record*> s_records{ nullptr };
+   static inline thread_local thread_record* t_record = nullptr;
+};
@@ -0,0 +1,127 @@
+// CppUnitTest.h : minimal stand-in for the Visual Studio native unit test
+// framework, so that unittest1.cpp builds and runs unchanged on Linux.
+// Only the subset used by the test suite is provided.
+
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace Microsoft
+{
+namespace VisualStudio
+{
+namespace CppUnitTestFramework
+{
+   struct assert_failed
+   {
+      std::wstring m_message;
+   };
+
+   struct test_entry
+   {
+      const char* m_methodName;
+      void (*m_run)();
+   };
+
+   inline std::vector<test_entry>& test_registry()
+   {
+      static std::vector<test_entry> registry;
+      return registry;
+   }
+
+   inline bool register_test(const char* i_methodName, void (*i_run)())
+   {
+      test_registry().push_back({ i_methodName, i_run });
+      return true;
+   }
+
+   template<class T>
+   struct test_class
+   {
+      using self_type = T;
+   };
+
+   class Assert
+   {
+   public:
+      static void IsTrue(bool i_condition, const wchar_t* i_message = nullptr)
+      {
+         if (!i_condition) fail(L"Assert::IsTrue failed", i_message);
+      }
+
+      static void IsFalse(bool i_condition, const wchar_t* i_message = nullptr)
+      {
+         if (i_condition) fail(L"Assert::IsFalse failed", i_message);
+      }
+
+      template<class T>
+      static void IsNull(const T* i_pointer, const wchar_t* i_message = nullptr)
+      {
+         if (i_pointer != nullptr) fail(L"Assert::IsNull failed", i_message);
+      }
+
+      template<class T>
+      static void IsNotNull(const T* i_pointer, const wchar_t* i_message = nullptr)
+      {
+         if (i_pointer == nullptr) fail(L"Assert::IsNotNull failed", i_message);
+      }
+
+      template<class T>
+      static void AreEqual(const T& i_expected, const T& i_actual, const wchar_t* i_message = nullptr)
+      {
+         if (!(i_expected == i_actual)) fail(L"Assert::AreEqual failed", i_message);
+      }
+
+      template<class TException, class TCallable>
+      static void ExpectException(TCallable i_callable, const wchar_t* i_message = nullptr)
+      {
+         try
+         {
+            i_callable();
+         }
+         catch (const TException&)
+         {
+            return;
+         }
+         catch (...)
+         {
+            fail(L"Assert::ExpectException caught an unexpected exception", i_message);
+         }
+         fail(L"Assert::ExpectException did not throw", i_message);
+      }
+
+      static void Fail(const wchar_t* i_message = nullptr)
+      {
+         fail(L"Assert::Fail", i_message);
+      }
+
+   private:
+      static void fail(const wchar_t* i_what, const wchar_t* i_message)
+      {
+         std::wstring message(i_what);
+         if (i_message)
+         {
+            message += L": ";
+            message += i_message;
+         }
+         throw assert_failed{ message };
+      }
+   };
+}
+}
+}
+
+#define TEST_CLASS(className) \
+   class className : public ::Microsoft::VisualStudio::CppUnitTestFramework::test_class<className>
+
+#define TEST_METHOD(methodName) \
+   static void methodName##_run() \
+   { \
+      self_type instance; \
+      instance.methodName(); \
+   } \
+   static inline const bool methodName##_registered = \
+      ::Microsoft::VisualStudio::CppUnitTestFramework::register_test(#methodName, &methodName##_run); \
+   void methodName()
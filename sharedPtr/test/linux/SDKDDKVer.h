@@ -0,0 +1,4 @@
+// SDKDDKVer.h : empty stand-in for the Windows SDK header pulled in by
+// targetver.h, so the test project's precompiled header builds on Linux.
+
+#pragma once
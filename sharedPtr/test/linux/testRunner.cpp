@@ -0,0 +1,41 @@
+// testRunner.cpp : runs every TEST_METHOD registered through the Linux
+// CppUnitTest.h stand-in and reports failures through the exit code.
+
+#include "CppUnitTest.h"
+
+#include <cstring>
+#include <exception>
+#include <iostream>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+
+int main(int argc, char* argv[])
+{
+   const char* filter = argc > 1 ? argv[1] : nullptr;
+   int failed = 0;
+   int run = 0;
+
+   for (const auto& test : test_registry())
+   {
+      if (filter && std::strstr(test.m_methodName, filter) == nullptr) continue;
+
+      ++run;
+      try
+      {
+         test.m_run();
+      }
+      catch (const assert_failed& i_failure)
+      {
+         ++failed;
+         std::wcout << L"FAILED " << test.m_methodName << L": " << i_failure.m_message << std::endl;
+      }
+      catch (const std::exception& i_exception)
+      {
+         ++failed;
+         std::wcout << L"FAILED " << test.m_methodName << L": unexpected exception " << i_exception.what() << std::endl;
+      }
+   }
+
+   std::wcout << run - failed << L"/" << run << L" tests passed" << std::endl;
+   return failed == 0 ? 0 : 1;
+}
@@ -1,9 +1,18 @@
 #include "stdafx.h"
 #include "CppUnitTest.h"
 #include "sharedPtr.h"
+#include "atomicSharedPtr.h"
+#include "epochSharedPtr.h"
+#include "intrusivePtr.h"
+#include "relocate.h"
 
+#include <algorithm>
 #include <thread>
 #include <future>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
 
 using namespace Microsoft::VisualStudio::CppUnitTestFramework;
 
@@ -28,11 +37,190 @@ namespace
       bool& m_destructorCalled;
    };
 
+   // Every thread writes its own slot before dropping its reference; the
+   // destructor, run by whichever thread releases last, must see all writes.
+   struct release_order_checker
+   {
+      static const int s_threadCount = 4;
+
+      release_order_checker(int& i_lostWrites) : m_lostWrites(i_lostWrites)
+      {
+      }
+
+      ~release_order_checker()
+      {
+         for (int i = 0; i < s_threadCount; i++)
+         {
+            if (m_writes[i] != 1) ++m_lostWrites;
+         }
+      }
+
+      int m_writes[s_threadCount] = {};
+      int& m_lostWrites;
+   };
+
+   struct allocation_counter
+   {
+      int m_allocations = 0;
+      int m_deallocations = 0;
+   };
+
    template<class T>
-   struct control_block_with_destructor : public control_block<T>
+   struct counting_allocator
+   {
+      using value_type = T;
+
+      counting_allocator(allocation_counter& i_counter) : m_counter(&i_counter)
+      {
+      }
+
+      template<class TOther>
+      counting_allocator(const counting_allocator<TOther>& i_other) : m_counter(i_other.m_counter)
+      {
+      }
+
+      T* allocate(std::size_t i_count)
+      {
+         ++m_counter->m_allocations;
+         return std::allocator<T>().allocate(i_count);
+      }
+
+      void deallocate(T* i_pointer, std::size_t i_count)
+      {
+         ++m_counter->m_deallocations;
+         std::allocator<T>().deallocate(i_pointer, i_count);
+      }
+
+      allocation_counter* m_counter;
+   };
+
+   template<class T, class TOther>
+   bool operator==(const counting_allocator<T>& i_lhs, const counting_allocator<TOther>& i_rhs)
+   {
+      return i_lhs.m_counter == i_rhs.m_counter;
+   }
+
+   template<class T, class TOther>
+   bool operator!=(const counting_allocator<T>& i_lhs, const counting_allocator<TOther>& i_rhs)
+   {
+      return !(i_lhs == i_rhs);
+   }
+
+   struct pooled_dummy_with_destructor : public dummy_with_destructor
+   {
+      using dummy_with_destructor::dummy_with_destructor;
+   };
+
+   struct self_referencing : public dummy_with_destructor, public enable_shared_from_this<self_referencing>
+   {
+      using dummy_with_destructor::dummy_with_destructor;
+   };
+
+   struct intrusive_node : public dummy_with_destructor, public intrusive_ref_counter<intrusive_node>
+   {
+      using dummy_with_destructor::dummy_with_destructor;
+   };
+
+   struct intrusive_derived : public intrusive_node
+   {
+      using intrusive_node::intrusive_node;
+   };
+
+   struct local_intrusive_node : public dummy_with_destructor, public intrusive_ref_counter<local_intrusive_node, local_ref_count>
+   {
+      using dummy_with_destructor::dummy_with_destructor;
+   };
+
+   struct weak_intrusive_node : public dummy_with_destructor, public intrusive_weak_ref_counter<weak_intrusive_node>
+   {
+      using dummy_with_destructor::dummy_with_destructor;
+   };
+
+   // Records the order objects are destroyed in; throws from the constructor
+   // once s_throwAfter objects were built.
+   struct array_element
+   {
+      array_element()
+      {
+         if (s_constructed == s_throwAfter) throw std::runtime_error("array_element");
+         m_index = s_constructed++;
+      }
+
+      ~array_element()
+      {
+         s_destroyed.push_back(m_index);
+      }
+
+      int m_index;
+
+      static int s_constructed;
+      static int s_throwAfter;
+      static std::vector<int> s_destroyed;
+   };
+
+   int array_element::s_constructed = 0;
+   int array_element::s_throwAfter = -1;
+   std::vector<int> array_element::s_destroyed;
+
+   // Holds a reference like the elements of a container of shared_ptrs, and
+   // throws from the copy that s_throwAt counts down to.
+   struct throwing_copy
+   {
+      explicit throwing_copy(shared_ptr<int> i_shared) : m_shared(std::move(i_shared))
+      {
+      }
+
+      throwing_copy(const throwing_copy& i_other) : m_shared(i_other.m_shared)
+      {
+         if (--s_throwAt == 0) throw std::runtime_error("throwing_copy");
+      }
+
+      throwing_copy(throwing_copy&&) noexcept = default;
+
+      shared_ptr<int> m_shared;
+
+      static int s_throwAt;
+   };
+
+   int throwing_copy::s_throwAt = 0;
+
+   struct alignas(32) over_aligned
+   {
+      char m_data[32];
+   };
+
+#if SHARED_PTR_ACCOUNTING
+   struct accounted_object
+   {
+      int m_value = 0;
+   };
+
+   struct deleter_owned
+   {
+      int m_value = 0;
+   };
+
+   struct zombie_tracked
+   {
+      int m_value = 0;
+   };
+
+   type_accounting_entry accounting_of(const char* i_type)
+   {
+      for (const auto& entry : type_accounting::snapshot())
+      {
+         if (entry.m_type.find(i_type) != std::string::npos) return entry;
+      }
+      return type_accounting_entry{ i_type, 0, 0, 0, 0, 0 };
+   }
+#endif
+
+   template<class T, class RefCount = atomic_ref_count>
+   struct control_block_with_destructor : public control_block<T, RefCount>
    {
-      control_block_with_destructor(T* i_pointer, bool& i_destructorCalled) : control_block(i_pointer), m_destructorCalled(i_destructorCalled)
+      control_block_with_destructor(T* i_pointer, bool& i_destructorCalled) : control_block<T, RefCount>(i_pointer), m_destructorCalled(i_destructorCalled)
       {
+         this->use_operations_of(this);
       }
 
       ~control_block_with_destructor()
@@ -52,20 +240,91 @@ namespace
       return shared;
    }
 
+   // atomic_ref_count that counts the read-modify-writes made on the strong
+   // and the weak counts.
+   struct counting_ref_count : public atomic_ref_count
+   {
+      using weak_ref_count = counting_ref_count;
+
+      static void increment(count_type& i_count)
+      {
+         ++s_operations;
+         atomic_ref_count::increment(i_count);
+      }
+
+      static bool increment_if_not_zero(count_type& i_count)
+      {
+         ++s_operations;
+         return atomic_ref_count::increment_if_not_zero(i_count);
+      }
+
+      static bool decrement(count_type& i_count)
+      {
+         ++s_operations;
+         return atomic_ref_count::decrement(i_count);
+      }
+
+      static int s_operations;
+   };
+
+   int counting_ref_count::s_operations = 0;
+
+   template<class T>
+   shared_ptr<T, counting_ref_count> get_shared_with_counting_control_block(T* i_pointer, bool& i_controlBlockDestructorCalled)
+   {
+      auto controlBlock = new control_block_with_destructor<T, counting_ref_count>(i_pointer, i_controlBlockDestructorCalled);
+      shared_ptr<T, counting_ref_count> shared;
+      shared.internal_reset(controlBlock->get(), controlBlock);
+      return shared;
+   }
+
+   constexpr std::size_t round_up(std::size_t i_size, std::size_t i_alignment)
+   {
+      return (i_size + i_alignment - 1) / i_alignment * i_alignment;
+   }
+
+   // Operations table pointer, the two counts and the object, nothing else.
+   template<class T>
+   constexpr std::size_t expected_element_block_size()
+   {
+      return round_up(round_up(sizeof(void*) + 2 * sizeof(ref_count_value), alignof(T)) + sizeof(T), alignof(T) > alignof(void*) ? alignof(T) : alignof(void*));
+   }
+
+   // Counts the live instances and poisons itself when destroyed, so a reader
+   // that got hold of a destroyed snapshot notices.
+   struct counted_snapshot
+   {
+      counted_snapshot(int i_value, std::atomic<int>& i_liveCount) : m_value(i_value), m_liveCount(i_liveCount)
+      {
+         ++m_liveCount;
+      }
+
+      ~counted_snapshot()
+      {
+         m_value = -1;
+         --m_liveCount;
+      }
+
+      int m_value;
+      std::atomic<int>& m_liveCount;
+   };
+
    template < class T >
    std::thread synchronize_start_thread(const T& i_callable)
    {
       std::promise<void> run;
       std::promise<void> ready;
+      auto runFuture = run.get_future();
+      auto readyFuture = ready.get_future();
 
-      auto threadMethod = [&i_callable, &run, &ready]()
+      auto threadMethod = [&i_callable, runFuture = std::move(runFuture), ready = std::move(ready)]() mutable
       {
          ready.set_value();
-         run.get_future().get();
+         runFuture.get();
          i_callable();
       };
-      std::thread worker(threadMethod);
-      ready.get_future().get();
+      std::thread worker(std::move(threadMethod));
+      readyFuture.get();
       run.set_value();
 
       return worker;
@@ -73,6 +332,11 @@ namespace
 
 }
 
+template<>
+struct use_control_block_pool<pooled_dummy_with_destructor> : std::true_type
+{
+};
+
 namespace test
 {
    TEST_CLASS(SharedPtrTests)
@@ -417,6 +681,22 @@ namespace test
          Assert::IsTrue(destructorCalled);
       }
 
+      TEST_METHOD(TestAliasingEmptyPointerOwnsNothing)
+      {
+         int value = 0;
+         shared_ptr<int> empty;
+         shared_ptr<int> aliased(empty, &value);
+         shared_ptr<int> movedFrom;
+         shared_ptr<int> aliasedByMove(std::move(movedFrom), &value);
+
+         auto copy = aliased;
+         auto moveCopy = aliasedByMove;
+         Assert::IsTrue(copy.get() == &value && moveCopy.get() == &value);
+         Assert::IsTrue(copy.get_control_block() == nullptr && moveCopy.get_control_block() == nullptr);
+         Assert::IsTrue(copy.use_count() == 0);
+         Assert::IsTrue(std::is_nothrow_copy_constructible<shared_ptr<int>>::value);
+      }
+
       TEST_METHOD(TestCustomDestructorCalled)
       {
          bool destructorCalled = false;
@@ -466,6 +746,20 @@ namespace test
          Assert::IsTrue(destructorCalled);
       }
 
+      TEST_METHOD(TestGetDeleter)
+      {
+         auto deleter = [](int* i_ptr)
+         {
+            delete i_ptr;
+         };
+         shared_ptr<int> shared(new int, deleter);
+         shared_ptr<int> sharedWithoutDeleter(new int);
+
+         Assert::IsNotNull(get_deleter<decltype(deleter)>(shared));
+         Assert::IsNull(get_deleter<void(*)(int*)>(shared));
+         Assert::IsNull(get_deleter<decltype(deleter)>(sharedWithoutDeleter));
+      }
+
       TEST_METHOD(TestMultithreadingAccess)
       {
          bool destructorCalled = false;
@@ -486,6 +780,28 @@ namespace test
          Assert::IsFalse(destructorCalled);
       }
 
+      TEST_METHOD(TestMultithreadingReleaseOrdersDestruction)
+      {
+         int lostWrites = 0;
+         for (int iteration = 0; iteration < 1000; iteration++)
+         {
+            auto shared = make_shared<release_order_checker>(lostWrites);
+            std::vector<std::thread> workers;
+            for (int i = 0; i < release_order_checker::s_threadCount; i++)
+            {
+               workers.emplace_back([localShared = shared, i]() mutable
+               {
+                  localShared->m_writes[i] = 1;
+                  localShared.reset();
+               });
+            }
+            shared.reset();
+            for (auto& worker : workers) worker.join();
+         }
+
+         Assert::IsTrue(lostWrites == 0);
+      }
+
       TEST_METHOD(TestWeakPtrInitWithZeroUseCount)
       {
          weak_ptr<int> weak;
@@ -658,64 +974,1229 @@ namespace test
          Assert::IsTrue(locked2.use_count() == 0);
       }
 
-      TEST_METHOD(TestConstructSharedPtrFromWeak)
+      TEST_METHOD(TestMultithreadingLockDoesNotResurrect)
       {
-         auto shared = make_shared<int>();
-         weak_ptr<int> weak = shared;
+         for (int i = 0; i < 10000; i++)
+         {
+            bool destructorCalled = false;
+            bool lockedDestroyedObject = false;
+            auto shared = make_shared<dummy_with_destructor>(destructorCalled);
+            weak_ptr<dummy_with_destructor> weak = shared;
+            auto lockLoop = [&weak, &destructorCalled, &lockedDestroyedObject]()
+            {
+               while (auto locked = weak.lock())
+               {
+                  if (destructorCalled) lockedDestroyedObject = true;
+               }
+            };
+            auto worker = synchronize_start_thread(lockLoop);
+
+            shared.reset();
+            worker.join();
+
+            Assert::IsFalse(lockedDestroyedObject);
+            Assert::IsTrue(destructorCalled);
+         }
+      }
 
-         shared_ptr<int> sharedFromWeak(weak);
+      TEST_METHOD(TestAtomicSharedPtrLoadStoreExchange)
+      {
+         atomic_shared_ptr<int> atomic;
+         Assert::IsTrue(atomic.load().get() == nullptr);
+         Assert::IsTrue(atomic.is_lock_free());
 
-         Assert::IsTrue(sharedFromWeak.get() == shared.get());
-         Assert::IsTrue(sharedFromWeak.use_count() == 2);
-         Assert::IsTrue(shared.use_count() == 2);
-         Assert::IsTrue(weak.use_count() == 2);
+         auto first = make_shared<int>(1);
+         atomic.store(first);
+         auto loaded = atomic.load();
+
+         Assert::IsTrue(loaded.get() == first.get());
+         Assert::IsTrue(first.use_count() == 3);
+
+         auto previous = atomic.exchange(make_shared<int>(2));
+
+         Assert::IsTrue(previous.get() == first.get());
+         Assert::IsTrue(first.use_count() == 3);
+         Assert::IsTrue(*atomic.load() == 2);
+
+         atomic = shared_ptr<int>();
+         Assert::IsTrue(atomic.load().get() == nullptr);
       }
 
-      TEST_METHOD(TestConstructSharedPtrFromWeakThrowsIfWeakExpired)
+      TEST_METHOD(TestAtomicSharedPtrCompareExchange)
       {
-         weak_ptr<int> weak;
-         auto shared = make_shared<int>();
-         weak_ptr<int> weak2 = shared;
-         shared.reset();
+         auto first = make_shared<int>(1);
+         auto second = make_shared<int>(2);
+         atomic_shared_ptr<int> atomic(first);
 
-         Assert::ExpectException<bad_weak_ptr>([&weak](){shared_ptr<int> shared(weak); });
-         Assert::ExpectException<bad_weak_ptr>([&weak2](){shared_ptr<int> shared(weak2); });
+         auto expected = second;
+         Assert::IsFalse(atomic.compare_exchange_strong(expected, second));
+         Assert::IsTrue(expected.get() == first.get());
+
+         Assert::IsTrue(atomic.compare_exchange_strong(expected, second));
+         Assert::IsTrue(atomic.load().get() == second.get());
+         Assert::IsTrue(first.use_count() == 2);
+
+         shared_ptr<int> aliased(first, second.get());
+         Assert::IsFalse(atomic.compare_exchange_weak(aliased, first));
+         Assert::IsTrue(aliased.get_control_block() == second.get_control_block());
       }
 
-      TEST_METHOD(TestControlBlockIsNotDestroyedIfSharedPtrExist)
+      TEST_METHOD(TestMultithreadingAtomicSharedPtrReadersAndWriter)
       {
-         bool controlBlockDestructorCalled = false;
-         auto shared = get_shared_with_custom_control_block(controlBlockDestructorCalled, 0);
-         weak_ptr<int> weak = shared;
-         weak_ptr<int> empty;
+         std::atomic<int> liveCount(0);
+         {
+            atomic_shared_ptr<counted_snapshot> atomic(shared_ptr<counted_snapshot>(new counted_snapshot(0, liveCount)));
+            std::atomic<bool> done(false);
+            bool readDestroyedSnapshot = false;
+            auto readLoop = [&atomic, &done, &readDestroyedSnapshot]()
+            {
+               while (!done)
+               {
+                  auto snapshot = atomic.load();
+                  if (snapshot->m_value < 0) readDestroyedSnapshot = true;
+               }
+            };
+            auto firstReader = synchronize_start_thread(readLoop);
+            auto secondReader = synchronize_start_thread(readLoop);
+
+            for (int i = 1; i < 20000; i++)
+            {
+               auto expected = atomic.load();
+               if (i % 2) atomic.store(shared_ptr<counted_snapshot>(new counted_snapshot(i, liveCount)));
+               else atomic.compare_exchange_strong(expected, shared_ptr<counted_snapshot>(new counted_snapshot(i, liveCount)));
+            }
+            done = true;
+            firstReader.join();
+            secondReader.join();
 
-         weak = empty;
+            Assert::IsFalse(readDestroyedSnapshot);
+            Assert::IsTrue(liveCount == 1);
+         }
 
-         Assert::IsTrue(shared.use_count() == 1);
-         Assert::IsFalse(controlBlockDestructorCalled);
+         Assert::IsTrue(liveCount == 0);
       }
 
-      TEST_METHOD(TestMultithreadingWeakPtrAccess)
+      TEST_METHOD(TestWeakPtrSwapSwapsPointers)
       {
-         bool controlBlockDestructorCalled = false;
-         auto shared = get_shared_with_custom_control_block(controlBlockDestructorCalled, 0);
-         weak_ptr<int> weak = shared;
-         shared.reset();
-         auto loop = [&weak]()
+         auto first = make_shared<int>(1);
+         auto second = make_shared<int>(2);
+         weak_ptr<int> firstWeak = first;
+         weak_ptr<int> secondWeak = second;
+
+         firstWeak.swap(secondWeak);
+
+         Assert::IsTrue(firstWeak.lock().get() == second.get());
+         Assert::IsTrue(secondWeak.lock().get() == first.get());
+
+         firstWeak = first;
+
+         Assert::IsTrue(firstWeak.lock().get() == first.get());
+      }
+
+      TEST_METHOD(TestAtomicWeakPtrLock)
+      {
+         auto first = make_shared<int>(1);
+         atomic_weak_ptr<int> atomic(first);
+
+         Assert::IsTrue(atomic.lock().get() == first.get());
+         Assert::IsTrue(first.use_count() == 1);
+
+         auto second = make_shared<int>(2);
+         weak_ptr<int> previous = atomic.exchange(second);
+
+         Assert::IsTrue(previous.lock().get() == first.get());
+         Assert::IsTrue(*atomic.lock() == 2);
+
+         weak_ptr<int> expected = first;
+         Assert::IsFalse(atomic.compare_exchange_strong(expected, first));
+         Assert::IsTrue(expected.lock().get() == second.get());
+         Assert::IsTrue(atomic.compare_exchange_strong(expected, first));
+         Assert::IsTrue(atomic.load().lock().get() == first.get());
+
+         first.reset();
+
+         Assert::IsTrue(atomic.lock().get() == nullptr);
+         Assert::IsTrue(atomic.load().expired());
+      }
+
+      TEST_METHOD(TestMultithreadingAtomicWeakPtrLockAndReplace)
+      {
+         std::atomic<int> liveCount(0);
          {
-            for (int i = 0; i < 100000; i++)
+            auto observer = shared_ptr<counted_snapshot>(new counted_snapshot(0, liveCount));
+            atomic_weak_ptr<counted_snapshot> atomic(observer);
+            std::atomic<bool> done(false);
+            bool lockedDestroyedObserver = false;
+            auto lockLoop = [&atomic, &done, &lockedDestroyedObserver]()
             {
-               auto localWeak = weak;
+               while (!done)
+               {
+                  if (auto locked = atomic.lock())
+                  {
+                     if (locked->m_value < 0) lockedDestroyedObserver = true;
+                  }
+               }
+            };
+            auto worker = synchronize_start_thread(lockLoop);
+
+            for (int i = 1; i < 20000; i++)
+            {
+               auto next = shared_ptr<counted_snapshot>(new counted_snapshot(i, liveCount));
+               atomic.store(next);
+               observer = next;
             }
-         };
-         auto worker = synchronize_start_thread(loop);
+            done = true;
+            worker.join();
 
-         loop();
-         worker.join();
+            Assert::IsFalse(lockedDestroyedObserver);
+            Assert::IsTrue(liveCount == 1);
+         }
 
-         Assert::IsFalse(controlBlockDestructorCalled);
-         weak.reset();
-         Assert::IsTrue(controlBlockDestructorCalled);
+         Assert::IsTrue(liveCount == 0);
+      }
+
+      TEST_METHOD(TestEpochSharedPtrDefersDestructionWhileBorrowed)
+      {
+         std::atomic<int> liveCount(0);
+         epoch_shared_ptr<counted_snapshot> slot(shared_ptr<counted_snapshot>(new counted_snapshot(1, liveCount)));
+         {
+            epoch_guard guard;
+            auto borrowed = slot.borrow(guard);
+            auto owned = borrowed.to_shared();
+
+            Assert::IsTrue(owned.get() == borrowed.get());
+            Assert::IsTrue(owned.use_count() == 2);
+
+            owned.reset();
+            slot.store(shared_ptr<counted_snapshot>(new counted_snapshot(2, liveCount)));
+            epoch_domain::reclaim();
+            epoch_domain::reclaim();
+
+            Assert::IsTrue(liveCount == 2);
+            Assert::IsTrue(borrowed->m_value == 1);
+            Assert::IsTrue(slot.load()->m_value == 2);
+         }
+
+         epoch_domain::reclaim();
+         epoch_domain::reclaim();
+
+         Assert::IsTrue(liveCount == 1);
+      }
+
+      TEST_METHOD(TestMultithreadingEpochSharedPtrReadersAndWriter)
+      {
+         std::atomic<int> liveCount(0);
+         {
+            epoch_shared_ptr<counted_snapshot> slot(shared_ptr<counted_snapshot>(new counted_snapshot(0, liveCount)));
+            std::atomic<bool> done(false);
+            bool readDestroyedSnapshot = false;
+            auto readLoop = [&slot, &done, &readDestroyedSnapshot]()
+            {
+               while (!done)
+               {
+                  epoch_guard guard;
+                  auto snapshot = slot.borrow(guard);
+                  if (snapshot->m_value < 0) readDestroyedSnapshot = true;
+               }
+            };
+            auto firstReader = synchronize_start_thread(readLoop);
+            auto secondReader = synchronize_start_thread(readLoop);
+
+            for (int i = 1; i < 20000; i++) slot.store(shared_ptr<counted_snapshot>(new counted_snapshot(i, liveCount)));
+            done = true;
+            firstReader.join();
+            secondReader.join();
+            epoch_domain::reclaim();
+            epoch_domain::reclaim();
+
+            Assert::IsFalse(readDestroyedSnapshot);
+            Assert::IsTrue(liveCount == 1);
+         }
+
+         epoch_domain::reclaim();
+         epoch_domain::reclaim();
+         Assert::IsTrue(liveCount == 0);
+      }
+
+      TEST_METHOD(TestRvaluePointerCastsTakeOverReference)
+      {
+         bool destructorCalled = false;
+         {
+            shared_ptr<dummy> base(new dummy_with_destructor(destructorCalled));
+            auto observer = base;
+
+            auto derived = static_pointer_cast<dummy_with_destructor>(std::move(base));
+            Assert::IsTrue(base.get() == nullptr && base.get_control_block() == nullptr);
+            Assert::IsTrue(derived.use_count() == 2);
+
+            auto failed = dynamic_pointer_cast<std::exception>(std::move(derived));
+            Assert::IsTrue(failed.get() == nullptr && failed.get_control_block() == nullptr);
+            Assert::IsTrue(derived.use_count() == 2);
+
+            auto constant = dynamic_pointer_cast<const dummy>(std::move(derived));
+            Assert::IsTrue(derived.get() == nullptr);
+            Assert::IsTrue(constant.get() == observer.get());
+
+            auto mutableAgain = const_pointer_cast<dummy>(std::move(constant));
+            Assert::IsTrue(constant.get_control_block() == nullptr);
+            Assert::IsTrue(mutableAgain.use_count() == 2);
+         }
+         Assert::IsTrue(destructorCalled);
+
+         destructorCalled = false;
+         {
+            intrusive_ptr<intrusive_node> base(new intrusive_derived(destructorCalled));
+
+            auto derived = static_pointer_cast<intrusive_derived>(std::move(base));
+            Assert::IsTrue(base == nullptr);
+            Assert::IsTrue(derived->use_count() == 1);
+
+            auto failed = dynamic_pointer_cast<local_intrusive_node>(std::move(derived));
+            Assert::IsTrue(failed == nullptr && derived != nullptr);
+
+            auto back = dynamic_pointer_cast<intrusive_node>(std::move(derived));
+            Assert::IsTrue(derived == nullptr);
+            Assert::IsTrue(back->use_count() == 1);
+         }
+         Assert::IsTrue(destructorCalled);
+      }
+
+      TEST_METHOD(TestMovesLeaveCountsAlone)
+      {
+         bool destructorCalled = false;
+         bool controlBlockDestructorCalled = false;
+         {
+            auto source = get_shared_with_counting_control_block(new dummy_with_destructor(destructorCalled), controlBlockDestructorCalled);
+            weak_ptr<dummy_with_destructor, counting_ref_count> weakSource = source;
+            const int operations = counting_ref_count::s_operations;
+
+            shared_ptr<dummy_with_destructor, counting_ref_count> moved(std::move(source));
+            shared_ptr<dummy, counting_ref_count> converted(std::move(moved));
+            shared_ptr<dummy, counting_ref_count> assigned;
+            assigned = std::move(converted);
+            shared_ptr<dummy_with_destructor, counting_ref_count> derived;
+            derived = static_pointer_cast<dummy_with_destructor>(std::move(assigned));
+            shared_ptr<dummy, counting_ref_count> convertedAssigned;
+            convertedAssigned = std::move(derived);
+            shared_ptr<bool, counting_ref_count> aliased(std::move(convertedAssigned), &destructorCalled);
+
+            weak_ptr<dummy_with_destructor, counting_ref_count> weakMoved(std::move(weakSource));
+            weak_ptr<dummy, counting_ref_count> weakConverted(std::move(weakMoved));
+            weak_ptr<dummy, counting_ref_count> weakAssigned;
+            weakAssigned = std::move(weakConverted);
+
+            Assert::IsTrue(counting_ref_count::s_operations == operations);
+            Assert::IsTrue(aliased.use_count() == 1);
+            Assert::IsTrue(weakSource.get_control_block() == nullptr && weakMoved.get_control_block() == nullptr);
+            Assert::IsTrue(weakAssigned.get_control_block() == aliased.get_control_block());
+
+            auto locked = weakAssigned.lock();
+            Assert::IsTrue(counting_ref_count::s_operations == operations + 1);
+            Assert::IsTrue(locked.use_count() == 2);
+         }
+         Assert::IsTrue(destructorCalled);
+         Assert::IsTrue(controlBlockDestructorCalled);
+      }
+
+      TEST_METHOD(TestVectorRelocatesByMove)
+      {
+         static_assert(std::is_nothrow_move_constructible<shared_ptr<int>>::value, "shared_ptr moves without throwing");
+         static_assert(std::is_nothrow_move_assignable<shared_ptr<int>>::value, "shared_ptr moves without throwing");
+         static_assert(std::is_nothrow_default_constructible<shared_ptr<int>>::value, "shared_ptr is null without throwing");
+         static_assert(std::is_nothrow_move_constructible<weak_ptr<int>>::value, "weak_ptr moves without throwing");
+         static_assert(std::is_nothrow_move_assignable<weak_ptr<int>>::value, "weak_ptr moves without throwing");
+         static_assert(std::is_nothrow_move_constructible<intrusive_ptr<intrusive_node>>::value, "intrusive_ptr moves without throwing");
+
+         bool destructorCalled = false;
+         bool controlBlockDestructorCalled = false;
+         {
+            auto source = get_shared_with_counting_control_block(new dummy_with_destructor(destructorCalled), controlBlockDestructorCalled);
+            weak_ptr<dummy_with_destructor, counting_ref_count> weakSource = source;
+
+            std::vector<shared_ptr<dummy_with_destructor, counting_ref_count>> shared;
+            std::vector<weak_ptr<dummy_with_destructor, counting_ref_count>> weak;
+            const int operations = counting_ref_count::s_operations;
+            for (int i = 0; i < 100; i++)
+            {
+               shared.push_back(source);
+               weak.push_back(weakSource);
+            }
+
+            // One increment per copy pushed, none for the reallocations.
+            Assert::IsTrue(counting_ref_count::s_operations == operations + 200);
+            Assert::IsTrue(source.use_count() == 101);
+         }
+         Assert::IsTrue(destructorCalled);
+         Assert::IsTrue(controlBlockDestructorCalled);
+      }
+
+      TEST_METHOD(TestRelocateLeavesCountsAlone)
+      {
+         static_assert(is_trivially_relocatable<shared_ptr<int>>::value, "shared_ptr relocates with memcpy");
+         static_assert(is_trivially_relocatable<std::pair<int, weak_ptr<int>>>::value, "pairs of relocatable types relocate with memcpy");
+         static_assert(!is_trivially_relocatable<std::pair<int, std::string>>::value, "std::string is relocated by move");
+
+         bool destructorCalled = false;
+         bool controlBlockDestructorCalled = false;
+         {
+            using pointer = shared_ptr<dummy_with_destructor, counting_ref_count>;
+            auto source = get_shared_with_counting_control_block(new dummy_with_destructor(destructorCalled), controlBlockDestructorCalled);
+
+            small_vector<pointer, 2> pointers;
+            for (int i = 0; i < 64; i++) pointers.push_back(source);
+            const int operations = counting_ref_count::s_operations;
+
+            pointers.reserve(1024);
+            pointers.insert(pointers.begin(), std::move(source));
+            pointers.erase(pointers.begin() + 10);
+            small_vector<pointer, 2> moved(std::move(pointers));
+
+            Assert::IsTrue(counting_ref_count::s_operations == operations + 1);
+            Assert::IsTrue(moved.size() == 64 && pointers.empty());
+            Assert::IsTrue(moved[0].use_count() == 64);
+         }
+         Assert::IsTrue(destructorCalled);
+         Assert::IsTrue(controlBlockDestructorCalled);
+      }
+
+      TEST_METHOD(TestSmallVectorStaysInPlaceUntilFull)
+      {
+         small_vector<std::string, 4> strings;
+         for (int i = 0; i < 4; i++) strings.push_back(std::to_string(i));
+         const std::string* inlineData = strings.data();
+
+         strings.insert(strings.begin() + 1, "inserted");
+         Assert::IsTrue(strings.data() != inlineData);
+         Assert::IsTrue(strings.size() == 5 && strings.capacity() >= 5);
+
+         strings.erase(strings.begin());
+         small_vector<std::string, 4> copy = strings;
+
+         const char* expected[] = { "inserted", "1", "2", "3" };
+         for (int i = 0; i < 4; i++)
+         {
+            Assert::IsTrue(strings[i] == expected[i]);
+            Assert::IsTrue(copy[i] == expected[i]);
+         }
+
+         small_vector<std::string, 4> small;
+         small.push_back("small");
+         small.swap(copy);
+         Assert::IsTrue(copy.size() == 1 && copy[0] == "small");
+         Assert::IsTrue(small.size() == 4 && small[0] == "inserted");
+      }
+
+      TEST_METHOD(TestSmallVectorCopyReleasesElementsOnThrow)
+      {
+         auto shared = make_shared<int>(0);
+         small_vector<throwing_copy, 2> elements;
+         for (int i = 0; i < 8; i++) elements.emplace_back(shared);
+         Assert::IsTrue(shared.use_count() == 9);
+
+         throwing_copy::s_throwAt = 5;
+         Assert::ExpectException<std::runtime_error>([&elements]() { small_vector<throwing_copy, 2> copy = elements; });
+         Assert::IsTrue(shared.use_count() == 9);
+
+         flat_map<int, throwing_copy> map;
+         for (int i = 0; i < 8; i++) map.try_emplace(i, shared);
+         throwing_copy::s_throwAt = 5;
+         Assert::ExpectException<std::runtime_error>([&map]() { flat_map<int, throwing_copy> copy = map; });
+         Assert::IsTrue(shared.use_count() == 17);
+      }
+
+      TEST_METHOD(TestFlatMapKeepsKeysSorted)
+      {
+         flat_map<int, shared_ptr<int>> map;
+         for (int key : { 5, 1, 4, 2, 3 }) map[key] = make_shared<int>(key * 10);
+
+         Assert::IsFalse(map.insert({ 3, make_shared<int>(0) }).second);
+         Assert::IsFalse(map.try_emplace(3).second);
+         Assert::IsTrue(map.size() == 5);
+
+         int expectedKey = 1;
+         for (auto& entry : map)
+         {
+            Assert::IsTrue(entry.first == expectedKey);
+            Assert::IsTrue(*entry.second == expectedKey * 10);
+            ++expectedKey;
+         }
+
+         Assert::IsTrue(map.erase(2) == 1);
+         Assert::IsTrue(map.erase(2) == 0);
+         Assert::IsTrue(map.find(2) == map.end());
+         Assert::IsTrue(map.count(4) == 1);
+         Assert::IsTrue(*map.find(4)->second == 40);
+      }
+
+      TEST_METHOD(TestIntrusivePtrCountsInObject)
+      {
+         static_assert(sizeof(intrusive_ptr<intrusive_node>) == sizeof(void*), "intrusive_ptr is a single pointer");
+
+         bool destructorCalled = false;
+         {
+            intrusive_ptr<intrusive_node> first(new intrusive_node(destructorCalled));
+            Assert::IsTrue(first->use_count() == 1);
+            {
+               auto second = first;
+               Assert::IsTrue(first->use_count() == 2);
+
+               auto third = std::move(second);
+               Assert::IsTrue(first->use_count() == 2);
+               Assert::IsTrue(second == nullptr);
+            }
+            Assert::IsTrue(first->use_count() == 1);
+
+            intrusive_node* raw = first.detach();
+            Assert::IsFalse(destructorCalled);
+            first.reset(raw, false);
+         }
+         Assert::IsTrue(destructorCalled);
+
+         destructorCalled = false;
+         {
+            intrusive_ptr<local_intrusive_node> local(new local_intrusive_node(destructorCalled));
+            auto copy = local;
+            Assert::IsTrue(local->use_count() == 2);
+         }
+         Assert::IsTrue(destructorCalled);
+      }
+
+      TEST_METHOD(TestIntrusivePtrCastsAndComparisons)
+      {
+         bool destructorCalled = false;
+         {
+            intrusive_ptr<intrusive_node> base(new intrusive_derived(destructorCalled));
+            intrusive_ptr<intrusive_node> other(new intrusive_node(destructorCalled));
+
+            auto derived = static_pointer_cast<intrusive_derived>(base);
+            Assert::IsTrue(derived == base);
+            Assert::IsTrue(base->use_count() == 2);
+
+            Assert::IsTrue(dynamic_pointer_cast<intrusive_derived>(base) == derived);
+            Assert::IsTrue(dynamic_pointer_cast<intrusive_derived>(other) == nullptr);
+
+            intrusive_ptr<const intrusive_node> constant = base;
+            Assert::IsTrue(const_pointer_cast<intrusive_node>(constant) == base);
+
+            Assert::IsTrue(base != other);
+            Assert::IsTrue((base < other) != (other < base));
+            Assert::IsTrue(base != nullptr);
+            Assert::IsFalse(intrusive_ptr<intrusive_node>() != nullptr);
+         }
+         Assert::IsTrue(destructorCalled);
+      }
+
+      TEST_METHOD(TestIntrusiveWeakRefCounter)
+      {
+         bool destructorCalled = false;
+         weak_ptr<weak_intrusive_node> weak;
+         {
+            intrusive_ptr<weak_intrusive_node> intrusive(new weak_intrusive_node(destructorCalled));
+            weak = intrusive->weak_from_this();
+            Assert::IsTrue(weak.use_count() == 1);
+
+            shared_ptr<weak_intrusive_node> shared = weak.lock();
+            Assert::IsTrue(shared.get() == intrusive.get());
+            Assert::IsTrue(intrusive->use_count() == 2);
+
+            intrusive.reset();
+            Assert::IsFalse(destructorCalled);
+
+            intrusive = shared.get();
+            shared.reset();
+            Assert::IsTrue(intrusive->use_count() == 1);
+         }
+         Assert::IsTrue(destructorCalled);
+         Assert::IsTrue(weak.expired());
+         Assert::IsTrue(weak.lock().get() == nullptr);
+
+         destructorCalled = false;
+         {
+            weak_intrusive_node unowned(destructorCalled);
+            Assert::IsTrue(unowned.weak_from_this().expired());
+         }
+         Assert::IsTrue(destructorCalled);
+      }
+
+      TEST_METHOD(TestConstructSharedPtrFromWeak)
+      {
+         auto shared = make_shared<int>();
+         weak_ptr<int> weak = shared;
+
+         shared_ptr<int> sharedFromWeak(weak);
+
+         Assert::IsTrue(sharedFromWeak.get() == shared.get());
+         Assert::IsTrue(sharedFromWeak.use_count() == 2);
+         Assert::IsTrue(shared.use_count() == 2);
+         Assert::IsTrue(weak.use_count() == 2);
+      }
+
+      TEST_METHOD(TestConstructSharedPtrFromWeakThrowsIfWeakExpired)
+      {
+         weak_ptr<int> weak;
+         auto shared = make_shared<int>();
+         weak_ptr<int> weak2 = shared;
+         shared.reset();
+
+         Assert::ExpectException<bad_weak_ptr>([&weak](){shared_ptr<int> shared(weak); });
+         Assert::ExpectException<bad_weak_ptr>([&weak2](){shared_ptr<int> shared(weak2); });
+      }
+
+      TEST_METHOD(TestControlBlockIsNotDestroyedIfSharedPtrExist)
+      {
+         bool controlBlockDestructorCalled = false;
+         auto shared = get_shared_with_custom_control_block(controlBlockDestructorCalled, 0);
+         weak_ptr<int> weak = shared;
+         weak_ptr<int> empty;
+
+         weak = empty;
+
+         Assert::IsTrue(shared.use_count() == 1);
+         Assert::IsFalse(controlBlockDestructorCalled);
+      }
+
+      TEST_METHOD(TestMultithreadingWeakPtrAccess)
+      {
+         bool controlBlockDestructorCalled = false;
+         auto shared = get_shared_with_custom_control_block(controlBlockDestructorCalled, 0);
+         weak_ptr<int> weak = shared;
+         shared.reset();
+         auto loop = [&weak]()
+         {
+            for (int i = 0; i < 100000; i++)
+            {
+               auto localWeak = weak;
+            }
+         };
+         auto worker = synchronize_start_thread(loop);
+
+         loop();
+         worker.join();
+
+         Assert::IsFalse(controlBlockDestructorCalled);
+         weak.reset();
+         Assert::IsTrue(controlBlockDestructorCalled);
+      }
+
+      TEST_METHOD(TestControlBlockDestroyedWithLastSharedIfNoWeakPtr)
+      {
+         bool controlBlockDestructorCalled = false;
+         auto shared = get_shared_with_custom_control_block(controlBlockDestructorCalled, 0);
+         auto shared2 = shared;
+
+         shared.reset();
+
+         Assert::IsFalse(controlBlockDestructorCalled);
+
+         shared2.reset();
+
+         Assert::IsTrue(controlBlockDestructorCalled);
+      }
+
+      TEST_METHOD(TestMultithreadingLastSharedAndWeakReleasedTogether)
+      {
+         for (int i = 0; i < 10000; i++)
+         {
+            bool controlBlockDestructorCalled = false;
+            auto shared = get_shared_with_custom_control_block(controlBlockDestructorCalled, 0);
+            weak_ptr<int> weak = shared;
+            auto releaseWeak = [&weak]()
+            {
+               weak.reset();
+            };
+            auto worker = synchronize_start_thread(releaseWeak);
+
+            shared.reset();
+            worker.join();
+
+            Assert::IsTrue(controlBlockDestructorCalled);
+         }
+      }
+
+      TEST_METHOD(TestLocalSharedPtrSharesOwnership)
+      {
+         bool destructorCalled = false;
+         auto shared = make_local_shared<dummy_with_destructor>(destructorCalled);
+         local_shared_ptr<dummy> shared2 = shared;
+
+         Assert::IsTrue(shared.use_count() == 2);
+
+         shared.reset();
+
+         Assert::IsFalse(destructorCalled);
+
+         shared2.reset();
+
+         Assert::IsTrue(destructorCalled);
+      }
+
+      TEST_METHOD(TestLocalWeakPtrLock)
+      {
+         local_shared_ptr<int> shared(new int(1));
+         local_weak_ptr<int> weak = shared;
+
+         auto locked = weak.lock();
+
+         Assert::IsTrue(locked.get() == shared.get());
+         Assert::IsTrue(weak.use_count() == 2);
+
+         locked.reset();
+         shared.reset();
+
+         Assert::IsTrue(weak.expired());
+         Assert::IsTrue(weak.lock().get() == nullptr);
+      }
+
+      TEST_METHOD(TestShardedSharedPtrSharesOwnership)
+      {
+         bool destructorCalled = false;
+         auto shared = make_shared_sharded<dummy_with_destructor>(destructorCalled);
+         sharded_weak_ptr<dummy_with_destructor> weak = shared;
+         auto copy = shared;
+
+         Assert::IsTrue(shared.use_count() == 2);
+         Assert::IsTrue(weak.lock().get() == shared.get());
+
+         shared.reset();
+         Assert::IsFalse(destructorCalled);
+
+         copy.reset();
+         Assert::IsTrue(destructorCalled);
+         Assert::IsTrue(weak.expired());
+         Assert::IsTrue(weak.lock().get() == nullptr);
+      }
+
+      TEST_METHOD(TestMultithreadingShardedSharedPtrReleasedOnOtherThreads)
+      {
+         bool destructorCalled = false;
+         auto shared = make_shared_sharded<dummy_with_destructor>(destructorCalled);
+         std::vector<std::vector<sharded_shared_ptr<dummy_with_destructor>>> copies(4);
+         std::vector<std::thread> workers;
+         for (auto& threadCopies : copies)
+         {
+            workers.emplace_back([&shared, &threadCopies]()
+            {
+               for (int i = 0; i < 1000; i++) threadCopies.push_back(shared);
+               for (int i = 0; i < 100000; i++)
+               {
+                  auto localShared = shared;
+               }
+            });
+         }
+         for (auto& worker : workers) worker.join();
+
+         Assert::IsTrue(shared.use_count() == 4001);
+
+         // Released on a thread that took none of them.
+         copies.clear();
+
+         Assert::IsTrue(shared.use_count() == 1);
+         Assert::IsFalse(destructorCalled);
+
+         shared.reset();
+         Assert::IsTrue(destructorCalled);
+      }
+
+      TEST_METHOD(TestMultithreadingShardedLockDoesNotResurrect)
+      {
+         for (int i = 0; i < 10000; i++)
+         {
+            bool destructorCalled = false;
+            bool lockedDestroyedObject = false;
+            auto shared = make_shared_sharded<dummy_with_destructor>(destructorCalled);
+            sharded_weak_ptr<dummy_with_destructor> weak = shared;
+            auto lockLoop = [&weak, &destructorCalled, &lockedDestroyedObject]()
+            {
+               while (auto locked = weak.lock())
+               {
+                  if (destructorCalled) lockedDestroyedObject = true;
+               }
+            };
+            auto worker = synchronize_start_thread(lockLoop);
+
+            shared.reset();
+            worker.join();
+
+            Assert::IsFalse(lockedDestroyedObject);
+            Assert::IsTrue(destructorCalled);
+         }
+      }
+
+      TEST_METHOD(TestSharedFromThisSharesControlBlock)
+      {
+         allocation_counter counter;
+         bool destructorCalled = false;
+         auto shared = allocate_shared<self_referencing>(counting_allocator<self_referencing>(counter), destructorCalled);
+
+         auto self = shared->shared_from_this();
+         auto weakSelf = shared->weak_from_this();
+
+         Assert::IsTrue(self.get() == shared.get());
+         Assert::IsTrue(self.get_control_block() == shared.get_control_block());
+         Assert::IsTrue(weakSelf.lock().get() == shared.get());
+         Assert::IsTrue(shared.use_count() == 2);
+         Assert::IsTrue(counter.m_allocations == 1);
+
+         self.reset();
+         shared.reset();
+
+         Assert::IsTrue(destructorCalled);
+         Assert::IsTrue(weakSelf.expired());
+
+         weakSelf.reset();
+         Assert::IsTrue(counter.m_deallocations == 1);
+      }
+
+      TEST_METHOD(TestSharedFromThisWithPointerConstructors)
+      {
+         bool destructorCalled = false;
+         shared_ptr<self_referencing> fromPointer(new self_referencing(destructorCalled));
+         Assert::IsTrue(fromPointer->shared_from_this().get_control_block() == fromPointer.get_control_block());
+
+         bool deleterCalled = false;
+         shared_ptr<self_referencing> withDeleter(new self_referencing(destructorCalled), [&deleterCalled](self_referencing* i_ptr)
+         {
+            deleterCalled = true;
+            delete i_ptr;
+         });
+         const self_referencing& constObject = *withDeleter;
+         shared_ptr<const self_referencing> constSelf = constObject.shared_from_this();
+
+         Assert::IsTrue(constSelf.get_control_block() == withDeleter.get_control_block());
+
+         constSelf.reset();
+         withDeleter.reset();
+         Assert::IsTrue(deleterCalled);
+      }
+
+      TEST_METHOD(TestSharedFromThisOwnedThroughBase)
+      {
+         bool destructorCalled = false;
+         shared_ptr<dummy_with_destructor> base(new self_referencing(destructorCalled), [](dummy_with_destructor* i_ptr) { delete static_cast<self_referencing*>(i_ptr); });
+         auto& object = static_cast<self_referencing&>(*base);
+         shared_ptr<self_referencing> self = object.shared_from_this();
+
+         Assert::IsTrue(self.get() == &object);
+         Assert::IsTrue(self.get_control_block() == base.get_control_block());
+         Assert::IsTrue(base.use_count() == 2);
+
+         self.reset();
+         base.reset();
+         Assert::IsTrue(destructorCalled);
+      }
+
+      TEST_METHOD(TestSharedFromThisOwnedAsConst)
+      {
+         bool destructorCalled = false;
+         shared_ptr<const self_referencing> constOwner(new self_referencing(destructorCalled));
+         shared_ptr<const self_referencing> self = constOwner->shared_from_this();
+
+         Assert::IsTrue(self.get() == constOwner.get());
+         Assert::IsTrue(self.get_control_block() == constOwner.get_control_block());
+         Assert::IsFalse(constOwner->weak_from_this().expired());
+
+         self.reset();
+         constOwner.reset();
+         Assert::IsTrue(destructorCalled);
+      }
+
+      TEST_METHOD(TestSharedFromThisThrowsIfNotOwned)
+      {
+         bool destructorCalled = false;
+         self_referencing unowned(destructorCalled);
+
+         Assert::IsTrue(unowned.weak_from_this().expired());
+         Assert::ExpectException<bad_weak_ptr>([&unowned]() { unowned.shared_from_this(); });
+
+         auto shared = make_shared<self_referencing>(destructorCalled);
+         self_referencing copy(*shared);
+
+         Assert::IsTrue(copy.weak_from_this().expired());
+      }
+
+      TEST_METHOD(TestMakeSharedArray)
+      {
+         auto shared = make_shared<int[]>(5);
+         auto offset = reinterpret_cast<char*>(shared.get()) - reinterpret_cast<char*>(shared.get_control_block());
+
+         Assert::IsTrue(offset > 0 && offset <= 64);
+         for (int i = 0; i < 5; i++) Assert::IsTrue(shared[i] == 0);
+
+         shared[4] = 4;
+         shared_ptr<int[]> copy = shared;
+         weak_ptr<int[]> weak = shared;
+
+         Assert::IsTrue(copy[4] == 4);
+         Assert::IsTrue(weak.lock()[4] == 4);
+         Assert::IsTrue(shared.use_count() == 2);
+
+         auto filled = make_shared<int[]>(3, 7);
+         Assert::IsTrue(filled[0] == 7 && filled[2] == 7);
+
+         auto empty = make_shared<int[]>(0);
+         Assert::IsTrue(empty.use_count() == 1);
+      }
+
+      TEST_METHOD(TestMakeSharedBoundedArray)
+      {
+         auto shared = make_shared<double[3]>();
+         Assert::IsTrue(shared[0] == 0.0 && shared[2] == 0.0);
+
+         auto filled = make_shared<int[2]>(9);
+         Assert::IsTrue(filled[0] == 9 && filled[1] == 9);
+
+         auto matrix = make_shared<int[][2]>(3);
+         matrix[2][1] = 5;
+         Assert::IsTrue(matrix[0][0] == 0 && matrix[2][1] == 5);
+
+         auto aligned = make_shared<over_aligned[]>(2);
+         Assert::IsTrue(reinterpret_cast<std::uintptr_t>(aligned.get()) % alignof(over_aligned) == 0);
+
+         auto overwritten = make_shared_for_overwrite<char[]>(64);
+         overwritten[63] = 'x';
+         Assert::IsTrue(make_shared_for_overwrite<int[4]>().use_count() == 1);
+      }
+
+      TEST_METHOD(TestMakeSharedForOverwrite)
+      {
+         struct buffer
+         {
+            int m_values[16];
+         };
+
+         auto shared = make_shared_for_overwrite<buffer>();
+         shared->m_values[15] = 15;
+
+         Assert::IsTrue(shared->m_values[15] == 15);
+         Assert::IsTrue(shared.use_count() == 1);
+
+         array_element::s_constructed = 0;
+         array_element::s_destroyed.clear();
+         {
+            auto element = make_shared_for_overwrite<array_element>();
+            Assert::IsTrue(array_element::s_constructed == 1);
+         }
+         Assert::IsTrue(array_element::s_destroyed.size() == 1);
+      }
+
+      TEST_METHOD(TestMakeSharedArrayDestroysElementsInReverse)
+      {
+         array_element::s_constructed = 0;
+         array_element::s_destroyed.clear();
+         {
+            auto shared = make_shared<array_element[]>(3);
+            Assert::IsTrue(array_element::s_destroyed.empty());
+         }
+
+         Assert::IsTrue(array_element::s_destroyed == std::vector<int>({ 2, 1, 0 }));
+
+         array_element::s_constructed = 0;
+         array_element::s_destroyed.clear();
+         array_element::s_throwAfter = 2;
+         Assert::ExpectException<std::runtime_error>([]() { make_shared<array_element[]>(4); });
+         array_element::s_throwAfter = -1;
+
+         Assert::IsTrue(array_element::s_destroyed == std::vector<int>({ 1, 0 }));
+      }
+
+      TEST_METHOD(TestSharedPtrToArrayUsesArrayDelete)
+      {
+         array_element::s_constructed = 0;
+         array_element::s_destroyed.clear();
+         {
+            shared_ptr<array_element[]> shared(new array_element[2]);
+            Assert::IsTrue(shared[1].m_index == 1);
+         }
+
+         Assert::IsTrue(array_element::s_destroyed.size() == 2);
+
+         Assert::IsTrue(std::is_constructible<shared_ptr<const array_element[]>, array_element*>::value);
+         Assert::IsFalse(std::is_constructible<shared_ptr<dummy[]>, dummy_with_destructor*>::value);
+      }
+
+      TEST_METHOD(TestAllocateSharedUsesAllocator)
+      {
+         allocation_counter counter;
+         bool destructorCalled = false;
+         {
+            auto shared = allocate_shared<dummy_with_destructor>(counting_allocator<dummy_with_destructor>(counter), destructorCalled);
+            auto shared2 = shared;
+
+            Assert::IsTrue(counter.m_allocations == 1);
+            Assert::IsTrue(shared.use_count() == 2);
+         }
+
+         Assert::IsTrue(destructorCalled);
+         Assert::IsTrue(counter.m_deallocations == 1);
+      }
+
+      TEST_METHOD(TestAllocateSharedFreesControlBlockAfterLastWeakPtr)
+      {
+         allocation_counter counter;
+         bool destructorCalled = false;
+         auto shared = allocate_shared<dummy_with_destructor>(counting_allocator<int>(counter), destructorCalled);
+         weak_ptr<dummy_with_destructor> weak = shared;
+
+         shared.reset();
+
+         Assert::IsTrue(destructorCalled);
+         Assert::IsTrue(counter.m_deallocations == 0);
+
+         weak.reset();
+
+         Assert::IsTrue(counter.m_deallocations == 1);
+      }
+
+      TEST_METHOD(TestDeleterConstructorWithAllocator)
+      {
+         allocation_counter counter;
+         bool destructorCalled = false;
+         auto deleter = [&destructorCalled](int* i_ptr)
+         {
+            destructorCalled = true;
+            delete i_ptr;
+         };
+
+         {
+            shared_ptr<int> shared(new int, deleter, counting_allocator<int>(counter));
+
+            Assert::IsTrue(counter.m_allocations == 1);
+         }
+
+         Assert::IsTrue(destructorCalled);
+         Assert::IsTrue(counter.m_deallocations == 1);
+      }
+
+      TEST_METHOD(TestMakeSharedBlockSize)
+      {
+         static_assert(sizeof(control_block_element<char>) == expected_element_block_size<char>(), "unexpected make_shared block size");
+         static_assert(sizeof(control_block_element<int>) == expected_element_block_size<int>(), "unexpected make_shared block size");
+         static_assert(sizeof(control_block_element<double>) == expected_element_block_size<double>(), "unexpected make_shared block size");
+         static_assert(sizeof(control_block_element<void*>) == expected_element_block_size<void*>(), "unexpected make_shared block size");
+         static_assert(sizeof(control_block_element<std::pair<int, int>>) == expected_element_block_size<std::pair<int, int>>(), "unexpected make_shared block size");
+         static_assert(sizeof(control_block_element<dummy>) == expected_element_block_size<dummy>(), "unexpected make_shared block size");
+         static_assert(sizeof(control_block<int>) == sizeof(void*) + 2 * sizeof(ref_count_value) + sizeof(int*), "unexpected control block size");
+      }
+
+      TEST_METHOD(TestMakeSharedPaddedSeparatesCountsFromObject)
+      {
+         bool destructorCalled = false;
+         auto shared = make_shared_padded<dummy_with_destructor>(destructorCalled);
+         auto controlBlock = reinterpret_cast<std::uintptr_t>(shared.get_control_block());
+         auto object = reinterpret_cast<std::uintptr_t>(shared.get());
+
+         Assert::IsTrue(object % SHARED_PTR_CACHE_LINE_SIZE == 0);
+         Assert::IsTrue(controlBlock / SHARED_PTR_CACHE_LINE_SIZE != object / SHARED_PTR_CACHE_LINE_SIZE);
+         Assert::IsTrue(sizeof(control_block_element_padded<dummy_with_destructor>) % SHARED_PTR_CACHE_LINE_SIZE == 0);
+
+         weak_ptr<dummy_with_destructor> weak = shared;
+         shared.reset();
+
+         Assert::IsTrue(destructorCalled);
+         Assert::IsTrue(weak.expired());
+      }
+
+      TEST_METHOD(TestStatelessAllocatorAddsNoSize)
+      {
+         Assert::IsTrue(sizeof(control_block_element_alloc<int, std::allocator<int>>) == sizeof(control_block_element<int>));
+         Assert::IsTrue(sizeof(control_block_element_alloc<int, counting_allocator<int>>) > sizeof(control_block_element<int>));
+      }
+
+      TEST_METHOD(TestEmptyDeleterAddsNoSize)
+      {
+         struct empty_deleter
+         {
+            void operator()(int* i_pointer) const
+            {
+               delete i_pointer;
+            }
+         };
+
+         Assert::IsTrue(sizeof(control_block_deleter<int, empty_deleter>) == sizeof(control_block<int>));
+         Assert::IsTrue(sizeof(control_block_deleter<int, void(*)(int*)>) > sizeof(control_block<int>));
+
+         shared_ptr<int> shared(new int(1), empty_deleter());
+         Assert::IsTrue(get_deleter<empty_deleter>(shared) != nullptr);
+      }
+
+      TEST_METHOD(TestTrivialPayloadSkipsDestroy)
+      {
+         using trivial_operations = control_block_operations<control_block_element<int>, atomic_ref_count>;
+         using destroyed_operations = control_block_operations<control_block_element<dummy_with_destructor>, atomic_ref_count>;
+
+         Assert::IsTrue(trivial_operations::s_operations.m_destroyAndDeallocate == &trivial_operations::free_object_and_block);
+         Assert::IsTrue(destroyed_operations::s_operations.m_destroyAndDeallocate == &destroyed_operations::destroy_and_deallocate);
+
+         auto shared = make_shared<int>(1);
+         weak_ptr<int> weak = shared;
+         shared.reset();
+         Assert::IsTrue(weak.expired());
+
+         bool destructorCalled = false;
+         make_shared<dummy_with_destructor>(destructorCalled);
+         Assert::IsTrue(destructorCalled);
+      }
+
+#if SHARED_PTR_ACCOUNTING
+      TEST_METHOD(TestTypeAccountingCountsLiveAndZombieBlocks)
+      {
+         const long long blockBytes = sizeof(control_block_element<zombie_tracked>);
+         const long long separateBytes = sizeof(control_block<zombie_tracked>) + sizeof(zombie_tracked);
+         {
+            auto first = make_shared<zombie_tracked>();
+            auto second = make_shared<zombie_tracked>();
+            shared_ptr<zombie_tracked> separate(new zombie_tracked);
+            weak_ptr<zombie_tracked> weak = second;
+            second.reset();
+
+            auto entry = accounting_of("zombie_tracked");
+            Assert::IsTrue(entry.m_liveObjects == 2);
+            Assert::IsTrue(entry.m_liveBlocks == 3);
+            Assert::IsTrue(entry.m_zombieBlocks == 1);
+            Assert::IsTrue(entry.m_bytes == 2 * blockBytes + separateBytes);
+
+            std::string json = type_accounting::to_json(type_accounting::snapshot());
+            Assert::IsTrue(json.find("\"zombie_blocks\":1") != std::string::npos);
+            Assert::IsTrue(type_accounting::to_text(type_accounting::snapshot()).find("zombie_tracked") != std::string::npos);
+         }
+
+         auto entry = accounting_of("zombie_tracked");
+         Assert::IsTrue(entry.m_liveObjects == 0 && entry.m_liveBlocks == 0 && entry.m_zombieBlocks == 0);
+         Assert::IsTrue(entry.m_bytes == 0);
+         Assert::IsTrue(entry.m_maxSampledBytes == 2 * blockBytes + separateBytes);
+      }
+
+      TEST_METHOD(TestTypeAccountingCountsObjectsOwnedThroughDeleter)
+      {
+         auto deleter = [](deleter_owned* i_ptr) { delete i_ptr; };
+         const long long deleterBytes = sizeof(control_block_deleter<deleter_owned, decltype(deleter)>) + sizeof(deleter_owned);
+         const long long allocatorBytes = sizeof(control_block_deleter_alloc<deleter_owned, std::default_delete<deleter_owned>, std::allocator<int>>) + sizeof(deleter_owned);
+         {
+            shared_ptr<deleter_owned> withDeleter(new deleter_owned, deleter);
+            shared_ptr<deleter_owned> withAllocator(new deleter_owned, std::default_delete<deleter_owned>(), std::allocator<int>());
+
+            auto entry = accounting_of("deleter_owned");
+            Assert::IsTrue(entry.m_liveObjects == 2);
+            Assert::IsTrue(entry.m_bytes == deleterBytes + allocatorBytes);
+         }
+         Assert::IsTrue(accounting_of("deleter_owned").m_bytes == 0);
+      }
+
+      TEST_METHOD(TestTypeAccountingMergesThreads)
+      {
+         {
+            std::vector<shared_ptr<accounted_object>> pointers;
+            std::thread([&pointers]() { for (int i = 0; i < 10; i++) pointers.push_back(make_shared<accounted_object>()); }).join();
+            Assert::IsTrue(accounting_of("accounted_object").m_liveObjects == 10);
+
+            // Freed on another thread than the one that allocated them.
+            pointers.resize(4);
+            Assert::IsTrue(accounting_of("accounted_object").m_liveObjects == 4);
+         }
+         Assert::IsTrue(accounting_of("accounted_object").m_liveBlocks == 0);
+
+         auto array = make_shared<accounted_object[]>(100);
+         Assert::IsTrue(accounting_of("accounted_object [").m_bytes >= static_cast<long long>(100 * sizeof(accounted_object)));
+      }
+#endif
+
+#if SHARED_PTR_CONTENTION_PROFILER
+      TEST_METHOD(TestContentionProfilerAttributesSamplesToBlocks)
+      {
+         contention_profiler::reset();
+         auto shared = make_shared<int>(1);
+         std::vector<std::thread> threads;
+         for (int i = 0; i < 4; i++)
+         {
+            threads.emplace_back([&shared]() { for (int j = 0; j < 100 * SHARED_PTR_CONTENTION_SAMPLE_PERIOD; j++) shared_ptr<int> copy = shared; });
+         }
+         for (auto& thread : threads) thread.join();
+
+         auto report = contention_profiler::report();
+         auto entry = std::find_if(report.begin(), report.end(), [&shared](const contention_entry& i_entry) { return i_entry.m_controlBlock == shared.get_control_block(); });
+         Assert::IsTrue(entry != report.end());
+         // One in a period of the copies and of the releases of every thread.
+         Assert::IsTrue(entry->m_samples == 4 * 2 * 100);
+         Assert::IsTrue(!entry->m_callSites.empty() && entry->m_callSites[0].m_address != nullptr);
+         Assert::IsTrue(std::is_sorted(report.begin(), report.end(), [](const contention_entry& i_lhs, const contention_entry& i_rhs) { return i_lhs.m_totalTicks > i_rhs.m_totalTicks; }));
+         Assert::IsTrue(contention_profiler::to_text(report).find("samples") != std::string::npos);
+      }
+
+      TEST_METHOD(TestContentionProfilerMakesRoomForHotBlocks)
+      {
+         contention_profiler::reset();
+         // Blocks sampled once, and never freed, fill every slot.
+         for (std::uintptr_t i = 1; i <= 2 * SHARED_PTR_CONTENTION_TABLE_SIZE; i++) contention_profiler::record(reinterpret_cast<const void*>(i * 64), nullptr, 1);
+
+         auto hot = make_shared<int>(1);
+         std::vector<std::thread> threads;
+         for (int i = 0; i < 4; i++)
+         {
+            threads.emplace_back([&hot]() { for (int j = 0; j < 10 * SHARED_PTR_CONTENTION_SAMPLE_PERIOD; j++) shared_ptr<int> copy = hot; });
+         }
+         for (auto& thread : threads) thread.join();
+
+         auto isHot = [&hot](const contention_entry& i_entry) { return i_entry.m_controlBlock == hot.get_control_block(); };
+         auto report = contention_profiler::report();
+         Assert::IsTrue(std::find_if(report.begin(), report.end(), isHot) != report.end());
+
+         // A freed block gives its slot back.
+         const void* block = hot.get_control_block();
+         hot.reset();
+         report = contention_profiler::report(SHARED_PTR_CONTENTION_TABLE_SIZE);
+         Assert::IsTrue(std::find_if(report.begin(), report.end(), [block](const contention_entry& i_entry) { return i_entry.m_controlBlock == block; }) == report.end());
+      }
+#endif
+
+      TEST_METHOD(TestPooledControlBlock)
+      {
+         bool destructorCalled = false;
+         shared_ptr<pooled_dummy_with_destructor> shared(new pooled_dummy_with_destructor(destructorCalled));
+         weak_ptr<pooled_dummy_with_destructor> weak = shared;
+
+         shared.reset();
+
+         Assert::IsTrue(destructorCalled);
+         Assert::IsTrue(weak.expired());
+      }
+
+      TEST_METHOD(TestMultithreadingPooledControlBlockFreedOnOtherThread)
+      {
+         const int count = 1000;
+         std::unique_ptr<bool[]> destructorsCalled(new bool[count]());
+         std::vector<shared_ptr<pooled_dummy_with_destructor>> shared;
+         for (int i = 0; i < count; i++)
+         {
+            shared.emplace_back(new pooled_dummy_with_destructor(destructorsCalled[i]));
+         }
+         auto release = [&shared]()
+         {
+            shared.clear();
+         };
+         auto worker = synchronize_start_thread(release);
+         worker.join();
+
+         for (int i = 0; i < count; i++)
+         {
+            bool destructorCalled = false;
+            shared_ptr<pooled_dummy_with_destructor> reused(new pooled_dummy_with_destructor(destructorCalled));
+         }
+
+         Assert::IsTrue(std::all_of(destructorsCalled.get(), destructorsCalled.get() + count, [](bool i_called) { return i_called; }));
+      }
+
+      TEST_METHOD(TestAllocateSharedWithPoolAllocator)
+      {
+         bool destructorCalled = false;
+         auto shared = allocate_shared<dummy_with_destructor>(control_block_pool_allocator<dummy_with_destructor>(), destructorCalled);
+         auto shared2 = shared;
+
+         Assert::IsTrue(shared.use_count() == 2);
+
+         shared.reset();
+         shared2.reset();
+
+         Assert::IsTrue(destructorCalled);
       }
 	};
-}
\ No newline at end of file
+}
\ No newline at end of file